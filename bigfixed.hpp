@@ -0,0 +1,262 @@
+#pragma once
+
+/*
+ * Fixed point numbers with any number of fractional bits, used for the
+ * reference orbits of deep zooms (see perturbation.hpp).
+ *
+ * A BigFixed is a sign and a magnitude made of 32 bit limbs, most
+ * significant first; the first limb is the integer part and each following
+ * one holds the next 32 bits of the fraction. Results are truncated to the
+ * number of limbs of the operands, which must all have the same length. The
+ * integer part has to stay below 2^32; nothing checks for overflow.
+ *
+ * This is all the reference orbit of z^2 + c needs: the values it takes
+ * stay small, and fixed point keeps addition cheap and every bit of the
+ * fraction significant.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fractals
+{
+
+class BigFixed
+{
+public:
+    // Zero, with 'limbs' limbs (one integer and limbs - 1 fractional ones).
+    explicit BigFixed(unsigned limbs) : negative_(false), limbs_(limbs, 0) {}
+
+    // The double 'x', exactly if there are enough limbs.
+    BigFixed(double x, unsigned limbs) : BigFixed(limbs)
+    {
+        negative_ = x < 0;
+        double frac = std::abs(x);
+        for (auto& limb : limbs_) {
+            const double whole = std::floor(frac);
+            limb = static_cast<std::uint32_t>(whole);
+            frac = (frac - whole) * radix;
+        }
+    }
+
+    /*
+     * A decimal number as written in an option file, e.g. "-0.75",
+     * "1.5e-3". Throws std::invalid_argument if it's malformed or its
+     * integer part doesn't fit. Numbers too small for 'limbs' are zero.
+     */
+    static BigFixed parse(const std::string& text, unsigned limbs);
+
+    // Number of limbs needed for 'bits' fractional bits.
+    static unsigned limbs_for(unsigned bits)
+    {
+        return 1 + (bits + 31) / 32;
+    }
+
+    unsigned size() const { return limbs_.size(); }
+
+    double to_double() const
+    {
+        double x = 0;
+        for (auto it = limbs_.rbegin(); it != limbs_.rend(); ++it)
+            x = x / radix + *it;
+        return negative_ ? -x : x;
+    }
+
+    BigFixed operator-() const
+    {
+        BigFixed r = *this;
+        r.negative_ = !negative_;
+        return r;
+    }
+
+    friend BigFixed operator+(const BigFixed& a, const BigFixed& b)
+    {
+        return add(a, b, b.negative_);
+    }
+
+    friend BigFixed operator-(const BigFixed& a, const BigFixed& b)
+    {
+        return add(a, b, !b.negative_);
+    }
+
+    friend BigFixed operator*(const BigFixed& a, const BigFixed& b)
+    {
+        // Limb i*j has weight 2^(-32*(i + j)); the columns past the last
+        // limb are only kept for their carries.
+        const unsigned n = a.size();
+        std::vector<std::uint64_t> cols(2*n, 0);
+        for (unsigned i = 0; i < n; ++i) {
+            std::uint64_t carry = 0;
+            for (unsigned j = n; j-- > 0; ) {
+                std::uint64_t t = std::uint64_t(a.limbs_[i]) * b.limbs_[j] +
+                                  cols[i + j + 1] + carry;
+                cols[i + j + 1] = t & mask;
+                carry = t >> 32;
+            }
+            cols[i] += carry;
+        }
+        for (unsigned k = 2*n - 1; k > 0; --k) {
+            cols[k - 1] += cols[k] >> 32;
+            cols[k] &= mask;
+        }
+        BigFixed r(n);
+        r.negative_ = a.negative_ != b.negative_;
+        // cols[0] would be the 2^32 place.
+        for (unsigned k = 0; k < n; ++k)
+            r.limbs_[k] = static_cast<std::uint32_t>(cols[k + 1]);
+        return r;
+    }
+
+    // Multiply by a small integer.
+    BigFixed& operator*=(std::uint32_t k)
+    {
+        std::uint64_t carry = 0;
+        for (unsigned i = size(); i-- > 0; ) {
+            std::uint64_t t = std::uint64_t(limbs_[i]) * k + carry;
+            limbs_[i] = static_cast<std::uint32_t>(t & mask);
+            carry = t >> 32;
+        }
+        return *this;
+    }
+
+    // Divide by a small integer, truncating.
+    BigFixed& operator/=(std::uint32_t k)
+    {
+        std::uint64_t rem = 0;
+        for (auto& limb : limbs_) {
+            std::uint64_t t = (rem << 32) | limb;
+            limb = static_cast<std::uint32_t>(t / k);
+            rem = t % k;
+        }
+        return *this;
+    }
+
+private:
+    static constexpr double radix = 4294967296.0;
+    static constexpr std::uint64_t mask = 0xffffffffu;
+
+    bool negative_;
+    std::vector<std::uint32_t> limbs_;
+
+    // Whether |a| < |b|.
+    static bool less_magnitude(const BigFixed& a, const BigFixed& b)
+    {
+        return std::lexicographical_compare(a.limbs_.begin(), a.limbs_.end(),
+                                            b.limbs_.begin(), b.limbs_.end());
+    }
+
+    // a + b, with b taken to have sign 'b_negative'.
+    static BigFixed add(const BigFixed& a, const BigFixed& b, bool b_negative)
+    {
+        const unsigned n = a.size();
+        BigFixed r(n);
+        if (a.negative_ == b_negative) {
+            std::uint64_t carry = 0;
+            for (unsigned i = n; i-- > 0; ) {
+                std::uint64_t t = std::uint64_t(a.limbs_[i]) + b.limbs_[i] +
+                                  carry;
+                r.limbs_[i] = static_cast<std::uint32_t>(t & mask);
+                carry = t >> 32;
+            }
+            r.negative_ = a.negative_;
+            return r;
+        }
+        // Subtract the smaller magnitude from the larger.
+        const bool swap = less_magnitude(a, b);
+        const BigFixed& big = swap ? b : a;
+        const BigFixed& small = swap ? a : b;
+        std::int64_t borrow = 0;
+        for (unsigned i = n; i-- > 0; ) {
+            std::int64_t t = std::int64_t(big.limbs_[i]) - small.limbs_[i] -
+                             borrow;
+            borrow = t < 0;
+            r.limbs_[i] = static_cast<std::uint32_t>(t + (borrow << 32));
+        }
+        r.negative_ = swap ? b_negative : a.negative_;
+        return r;
+    }
+};
+
+inline BigFixed BigFixed::parse(const std::string& text, unsigned limbs)
+{
+    auto fail = [&]()
+    {
+        return std::invalid_argument("Bad number '" + text + "'");
+    };
+
+    std::size_t pos = 0;
+    bool negative = false;
+    if (pos < text.size() && (text[pos] == '-' || text[pos] == '+'))
+        negative = text[pos++] == '-';
+
+    // All the digits of the mantissa, and how many are before the point.
+    std::string digits;
+    long point = -1;
+    for (; pos < text.size() && text[pos] != 'e' && text[pos] != 'E'; ++pos) {
+        if (text[pos] == '.' && point < 0)
+            point = digits.size();
+        else if (std::isdigit(static_cast<unsigned char>(text[pos])))
+            digits.push_back(text[pos]);
+        else
+            throw fail();
+    }
+    if (digits.empty())
+        throw fail();
+    if (point < 0)
+        point = digits.size();
+
+    long exponent = 0;
+    if (pos < text.size()) {
+        try {
+            std::size_t used;
+            exponent = std::stol(text.substr(pos + 1), &used);
+            if (pos + 1 + used != text.size())
+                throw fail();
+        } catch (const std::logic_error&) {
+            throw fail();
+        }
+    }
+
+    // Leading zeros only move the point, and zero is zero whatever the
+    // exponent.
+    const std::size_t first = digits.find_first_not_of('0');
+    if (first == std::string::npos)
+        return BigFixed(limbs);
+    digits.erase(0, first);
+    point -= static_cast<long>(first);
+
+    // The value is now at least 0.1 * 10^(point + exponent). The integer
+    // part has 32 bits, a bit under 10 digits, and each further limb holds
+    // a bit under 10 digits of the fraction; outside that range the scaling
+    // below would only overflow or end at zero, after as many steps as the
+    // exponent says. (Checked before adding so that can't overflow.)
+    const long max_scale = 10;
+    const long min_scale = -10 * static_cast<long>(limbs);
+    if (exponent > max_scale - point)
+        throw fail();
+    if (exponent < min_scale - point)
+        return BigFixed(limbs);
+
+    // 0.d1 d2 d3 ... from the last digit up, then scaled by 10^(point + e).
+    BigFixed r(limbs);
+    for (auto it = digits.rbegin(); it != digits.rend(); ++it) {
+        r.limbs_[0] = *it - '0';
+        r /= 10;
+    }
+    for (long e = point + exponent; e > 0; --e) {
+        if (r.limbs_[0] >= 429496729u)
+            throw fail();
+        r *= 10;
+    }
+    for (long e = point + exponent; e < 0; ++e)
+        r /= 10;
+    r.negative_ = negative;
+    return r;
+}
+
+}
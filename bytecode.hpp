@@ -0,0 +1,334 @@
+#pragma once
+
+/*
+ * A register based bytecode for evaluating a parsed function f(z, c).
+ *
+ * A Program is a linear list of instructions, each reading one or two
+ * registers and writing a third, compiled from an Expression. Registers 0 and
+ * 1 hold z and c; constants are loaded into their own registers once, when
+ * the register file is set up, and temporaries are reused as soon as their
+ * value is dead. Evaluating the function is then a single loop over the
+ * instructions without any indirect calls, which is what the escape time
+ * loops in options.hpp want to run on every iteration.
+ *
+ * Only part of a function changes from one iteration to the next: anything
+ * that doesn't depend on z, like sin(c) in z^2 + sin(c), has the same value
+ * for the whole escape time loop (when c is the test point) or even the whole
+ * image (when c is the constant). Instructions are therefore split into a
+ * setup part, computing everything that only depends on c, followed by the
+ * part that has to run on every iteration. The registers holding setup
+ * results that the rest of the program reads are never reused, so setup()
+ * can be run once and step() as often as needed afterwards.
+ */
+
+#include "expression.hpp"
+
+#include <complex>
+#include <vector>
+
+namespace fractals {
+
+namespace fn_parser {
+
+struct Instruction
+{
+    op code;
+    unsigned dst;
+    unsigned a;
+    unsigned b;
+};
+
+template <typename cmplx>
+class Program
+{
+public:
+    static constexpr unsigned z_register = 0;
+    static constexpr unsigned c_register = 1;
+
+    Program() = default;
+    explicit Program(const Expression& expr);
+
+    unsigned num_registers() const { return initial_.size(); }
+    unsigned result_register() const { return result_; }
+
+    // Values the register file should hold before the first run; z and c
+    // are zero and should be filled in by the caller.
+    const std::vector<cmplx>& initial_registers() const { return initial_; }
+    const std::vector<Instruction>& instructions() const { return code_; }
+
+    // initial_registers() with c filled in and setup() already run, for
+    // when c is the same for every point.
+    std::vector<cmplx> initial_registers(const cmplx& c) const;
+
+    // The first setup_size() instructions are the ones that don't depend
+    // on z.
+    unsigned setup_size() const { return setup_size_; }
+
+    // Run the setup part on a register file set up from initial_registers()
+    // with c filled in.
+    void setup(cmplx* regs) const { execute(regs, 0, setup_size_); }
+
+    // Run the rest of the program on a register file that has been through
+    // setup() and has z filled in, and return the result.
+    cmplx step(cmplx* regs) const
+    {
+        execute(regs, setup_size_, code_.size());
+        return regs[result_];
+    }
+
+    // Execute the whole program on a register file set up from
+    // initial_registers() with z and c filled in and return the result.
+    cmplx run(cmplx* regs) const
+    {
+        setup(regs);
+        return step(regs);
+    }
+
+    // Convenience for one-off evaluations; sets up a register file first.
+    cmplx operator()(const cmplx& z, const cmplx& c) const;
+
+private:
+    std::vector<Instruction> code_;
+    std::vector<cmplx> initial_;
+    unsigned setup_size_ = 0;
+    unsigned result_ = z_register;
+
+    void execute(cmplx* regs, unsigned first, unsigned last) const;
+};
+
+/*
+ * Storage for the registers of a Program (or anything else laid out the same
+ * way). Small register files live on the stack so that setting one up per
+ * test point doesn't allocate.
+ */
+template <typename cmplx>
+class RegisterFile
+{
+public:
+    explicit RegisterFile(const Program<cmplx>& prog) :
+        RegisterFile(prog.initial_registers()) {}
+
+    explicit RegisterFile(const std::vector<cmplx>& init)
+    {
+        if (init.size() <= local_size) {
+            regs_ = local_;
+        } else {
+            heap_.resize(init.size());
+            regs_ = heap_.data();
+        }
+        for (unsigned i = 0; i < init.size(); ++i)
+            regs_[i] = init[i];
+    }
+
+    RegisterFile(const RegisterFile&) = delete;
+    RegisterFile& operator=(const RegisterFile&) = delete;
+
+    cmplx* data() { return regs_; }
+    cmplx& operator[](unsigned i) { return regs_[i]; }
+
+private:
+    static constexpr unsigned local_size = 32;
+    cmplx local_[local_size];
+    std::vector<cmplx> heap_;
+    cmplx* regs_;
+};
+
+template <typename cmplx>
+Program<cmplx>::Program(const Expression& expr)
+{
+    const unsigned n = expr.size();
+    const unsigned never = n;
+
+    // Only nodes reachable from the root get code generated for them.
+    std::vector<bool> live(n, false);
+    live[expr.root()] = true;
+    for (unsigned i = n; i-- > 0; ) {
+        if (!live[i])
+            continue;
+        unsigned nargs = arity(expr[i].code);
+        if (nargs > 0)
+            live[expr[i].lhs] = true;
+        if (nargs > 1)
+            live[expr[i].rhs] = true;
+    }
+
+    // Which nodes depend on z. Nodes that don't are computed first, in the
+    // setup part, and the rest in pool order after them.
+    std::vector<bool> varies(n, false);
+    for (unsigned i = 0; i < n; ++i) {
+        unsigned nargs = arity(expr[i].code);
+        varies[i] = expr[i].code == op::Z ||
+                    (nargs > 0 && varies[expr[i].lhs]) ||
+                    (nargs > 1 && varies[expr[i].rhs]);
+    }
+    std::vector<unsigned> order;
+    for (unsigned i = 0; i < n; ++i)
+        if (live[i] && !varies[i])
+            order.push_back(i);
+    for (unsigned i = 0; i < n; ++i)
+        if (live[i] && varies[i])
+            order.push_back(i);
+
+    // Index of the last node reading each node's value. Setup results read
+    // after the setup part have to survive every iteration.
+    std::vector<unsigned> last_use(n, 0);
+    for (unsigned i : order) {
+        unsigned nargs = arity(expr[i].code);
+        unsigned args[2] = {expr[i].lhs, expr[i].rhs};
+        for (unsigned k = 0; k < nargs; ++k) {
+            unsigned arg = args[k];
+            last_use[arg] = varies[i] && !varies[arg] ? never : i;
+        }
+    }
+    last_use[expr.root()] = never;
+
+    initial_.assign(2, cmplx(0));
+    std::vector<unsigned> reg(n, 0);
+    std::vector<bool> is_temp(2, false);
+    std::vector<unsigned> free_regs;
+
+    auto release = [&](unsigned node, unsigned user)
+    {
+        if (last_use[node] == user && is_temp[reg[node]])
+            free_regs.push_back(reg[node]);
+    };
+
+    for (unsigned i : order) {
+        const Node& node = expr[i];
+        switch (node.code) {
+        case op::Z:
+            reg[i] = z_register;
+            continue;
+        case op::C:
+            reg[i] = c_register;
+            continue;
+        case op::CONSTANT:
+            reg[i] = initial_.size();
+            initial_.push_back(cmplx(node.value.real(), node.value.imag()));
+            is_temp.push_back(false);
+            continue;
+        default:
+            break;
+        }
+
+        unsigned nargs = arity(node.code);
+        Instruction ins{node.code, 0, reg[node.lhs], 0};
+        if (nargs > 1)
+            ins.b = reg[node.rhs];
+
+        // Operands are read before the destination is written, so a dead
+        // operand's register can be handed straight to the result.
+        release(node.lhs, i);
+        if (nargs > 1 && node.rhs != node.lhs)
+            release(node.rhs, i);
+
+        if (free_regs.empty()) {
+            ins.dst = initial_.size();
+            initial_.push_back(cmplx(0));
+            is_temp.push_back(true);
+        } else {
+            ins.dst = free_regs.back();
+            free_regs.pop_back();
+        }
+        reg[i] = ins.dst;
+        code_.push_back(ins);
+        if (!varies[i])
+            setup_size_ = code_.size();
+    }
+    result_ = reg[expr.root()];
+}
+
+template <typename cmplx>
+std::vector<cmplx> Program<cmplx>::initial_registers(const cmplx& c) const
+{
+    std::vector<cmplx> regs = initial_;
+    regs[c_register] = c;
+    setup(regs.data());
+    return regs;
+}
+
+template <typename cmplx>
+inline void Program<cmplx>::execute(cmplx* regs, unsigned first,
+                                    unsigned last) const
+{
+    for (unsigned i = first; i < last; ++i) {
+        const Instruction& ins = code_[i];
+        const cmplx& a = regs[ins.a];
+        const cmplx& b = regs[ins.b];
+        switch (ins.code) {
+        case op::NEG:
+            regs[ins.dst] = -a;
+            break;
+        case op::ADD:
+            regs[ins.dst] = a + b;
+            break;
+        case op::SUB:
+            regs[ins.dst] = a - b;
+            break;
+        case op::MUL:
+            regs[ins.dst] = a * b;
+            break;
+        case op::DIV:
+            regs[ins.dst] = a / b;
+            break;
+        case op::POW:
+            regs[ins.dst] = std::pow(a, b);
+            break;
+        case op::SQUARE:
+            regs[ins.dst] = cmplx(a.real() * a.real() - a.imag() * a.imag(),
+                                  2 * a.real() * a.imag());
+            break;
+        case op::ABS:
+            regs[ins.dst] = cmplx(std::abs(a));
+            break;
+        case op::EXP:
+            regs[ins.dst] = std::exp(a);
+            break;
+        case op::SIN:
+            regs[ins.dst] = std::sin(a);
+            break;
+        case op::COS:
+            regs[ins.dst] = std::cos(a);
+            break;
+        case op::TAN:
+            regs[ins.dst] = std::tan(a);
+            break;
+        case op::ASIN:
+            regs[ins.dst] = std::asin(a);
+            break;
+        case op::ACOS:
+            regs[ins.dst] = std::acos(a);
+            break;
+        case op::ATAN:
+            regs[ins.dst] = std::atan(a);
+            break;
+        case op::SQRT:
+            regs[ins.dst] = std::sqrt(a);
+            break;
+        case op::REAL:
+            regs[ins.dst] = cmplx(a.real());
+            break;
+        case op::IMAG:
+            regs[ins.dst] = cmplx(0, a.imag());
+            break;
+        case op::CONJ:
+            regs[ins.dst] = std::conj(a);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+template <typename cmplx>
+inline cmplx Program<cmplx>::operator()(const cmplx& z, const cmplx& c) const
+{
+    RegisterFile<cmplx> regs(*this);
+    regs[z_register] = z;
+    regs[c_register] = c;
+    return run(regs.data());
+}
+
+}
+
+}
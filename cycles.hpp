@@ -0,0 +1,40 @@
+#pragma once
+
+/*
+ * Detection of periodic orbits in the escape time loops.
+ *
+ * Points inside a fractal never escape, so testing them costs the full
+ * max_iterations. Most of them, though, are attracted to a cycle, and once
+ * an orbit has settled on one it's known never to escape. The loops can look
+ * for this with Brent's method: the orbit is saved whenever the iteration
+ * count reaches a power of two, and every following iterate is compared with
+ * the saved one. A cycle of period p is caught after at most about twice the
+ * number of iterations it takes to settle plus 2p.
+ *
+ * "The same" means equal to within a few units in the last place of the
+ * number type, so this works in any precision. Points found to be periodic
+ * are reported as not escaping (0), as they would be without the check.
+ */
+
+#include <limits>
+
+namespace fractals {
+
+namespace fn_parser {
+
+// Largest distance (in the 1-norm) between two iterates taken as equal.
+template <typename real>
+constexpr real cycle_tolerance()
+{
+    return 16 * std::numeric_limits<real>::epsilon();
+}
+
+// Whether the orbit should be saved after 'iters' iterations.
+inline bool cycle_checkpoint(unsigned iters)
+{
+    return (iters & (iters - 1)) == 0;
+}
+
+}
+
+}
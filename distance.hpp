@@ -0,0 +1,253 @@
+#pragma once
+
+/*
+ * Skipping the exterior of the Mandelbrot set with distance estimates.
+ *
+ * Outside the Mandelbrot set, G(c) = lim log|z_n| / 2^n (the Green's
+ * function) is smooth, and by the Koebe quarter theorem no point of the set
+ * is closer to c than
+ *
+ *     sinh(G) / (2 e^G |grad G|).
+ *
+ * Both G and its gradient come out of iterating z and dz/dc a few steps past
+ * the escape radius (the function's DualProgram, see dual.hpp, gives dz/dc
+ * along with z), so one iterated point proves a whole disk around it
+ * free of the set. Tiles of the image inside such a disk (a quarter of it,
+ * where the orbit is still close to linear in c) aren't iterated: the
+ * escape time of each of their points is read off the orbit of the tile's
+ * center, extrapolated to first order with dz/dc, around the iteration where
+ * the center escapes. Tiles that can't be settled like that are cut in four,
+ * down to a few points across, and those are tested as usual. The boundary
+ * of the set, where the disks shrink to nothing, is always tested point by
+ * point; a few of the skipped points' escape times, at the edges of the
+ * bands of equal escape time, can be off by one.
+ *
+ * Only for z^2 + c from z = 0 with the test point as c.
+ */
+
+#include "dual.hpp"
+#include "fractals.hpp"
+#include "vector_slice.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+namespace fractals
+{
+
+// Largest and smallest tiles, in points across.
+constexpr unsigned max_distance_tile = 32;
+constexpr unsigned min_distance_tile = 4;
+
+// Iterations kept on either side of the one where a point escapes.
+constexpr int exterior_window = 3;
+
+/*
+ * What iterating one point says about the points around it: its escape time
+ * ('iters', 0 if it doesn't escape), and if it escapes, a lower bound on the
+ * distance to the set and the orbit z_k and dz_k/dc for k from iters - window
+ * to iters + window (k - iters + window in the arrays).
+ */
+struct ExteriorEstimate
+{
+    unsigned iters = 0;
+    double distance = 0;
+    std::complex<double> z[2*exterior_window + 1];
+    std::complex<double> dz[2*exterior_window + 1];
+    // How many of z and dz are set; the orbit can reach |z| = 'far' (see
+    // below) before iters + window, and it's past any escape radius there.
+    int known = 0;
+};
+
+// 'f' is the iterated function with its derivatives.
+inline ExteriorEstimate estimate_exterior(
+    const fn_parser::DualProgram<std::complex<double>>& f,
+    const std::complex<double>& c, double escape, unsigned max_iters)
+{
+    using Dual = fn_parser::Dual<std::complex<double>>;
+
+    // Iterations past the escape radius, until |z| is at least 'far'.
+    const double far = 1e8;
+    const unsigned max_extra = 64;
+    const int w = exterior_window;
+
+    ExteriorEstimate e;
+    // z_0 = 0 doesn't depend on c; each step carries dz/dc along through
+    // the chain rule.
+    const Dual dc = Dual::c(c);
+    Dual d{0, 0, 0, 0, 0};
+    std::complex<double> z = 0, dz = 0;
+    std::complex<double> last_z[w + 1], last_dz[w + 1];
+    const double escape2 = escape * escape;
+    unsigned n = 0;
+    while (true) {
+        last_z[n % (w + 1)] = z;
+        last_dz[n % (w + 1)] = dz;
+        if (std::norm(z) >= escape2 || n == max_iters)
+            break;
+        d = f(d, dc);
+        z = d.value;
+        dz = d.dc;
+        n += 1;
+    }
+    if (n == max_iters)
+        return e;
+    e.iters = n;
+    for (int k = -w; k <= 0; ++k)
+        if (int(n) + k >= 0) {
+            e.z[k + w] = last_z[(n + k) % (w + 1)];
+            e.dz[k + w] = last_dz[(n + k) % (w + 1)];
+        }
+    e.known = w + 1;
+    for (unsigned k = 0; k < max_extra && std::norm(z) < far*far; ++k) {
+        d = f(d, dc);
+        z = d.value;
+        dz = d.dc;
+        n += 1;
+        if (e.known < 2*w + 1) {
+            e.z[e.known] = z;
+            e.dz[e.known] = dz;
+            e.known += 1;
+        }
+    }
+
+    // G = log|z_n| / 2^n; as a function of c the length of its gradient is
+    // |dz/z| / 2^n.
+    const double scale = std::ldexp(1.0, -static_cast<int>(n));
+    const double g = std::log(std::abs(z)) * scale;
+    const double grad = std::abs(dz / z) * scale;
+    if (grad > 0)
+        e.distance = std::sinh(g) / (2 * std::exp(g) * grad);
+    return e;
+}
+
+/*
+ * Fills the points (i, j) with i0 <= i < i1 and j0 <= j < j1 of a domain
+ * into out[i*out.stride() + j] as described above, like subdivide() in
+ * subdivide.hpp does. 'kernel' tests points as described for KernelSpec in
+ * options.hpp; 'f' is the function with its derivatives and 'escape' and
+ * 'max_iters' are its escape radius and iteration limit.
+ */
+template <typename cmplx, typename Kernel>
+void distance_fill(const Domain<cmplx>& dom, vector_slice<unsigned>& out,
+                   const Kernel& kernel,
+                   const fn_parser::DualProgram<std::complex<double>>& f,
+                   double escape, unsigned max_iters,
+                   unsigned i0, unsigned i1, unsigned j0, unsigned j1);
+
+namespace
+{
+
+template <typename cmplx, typename Kernel>
+class DistanceFill
+{
+public:
+    using real = typename cmplx::value_type;
+
+    DistanceFill(const Domain<cmplx>& dom, vector_slice<unsigned>& out,
+                 const Kernel& kernel,
+                 const fn_parser::DualProgram<std::complex<double>>& f,
+                 double escape, unsigned max_iters) :
+        dom_(dom), out_(out), kernel_(kernel), f_(f), escape_(escape),
+        max_iters_(max_iters)
+    {
+        dx_ = dom.nacross > 1 ? (dom.upper_right.real() -
+                                 dom.lower_left.real()) / (dom.nacross - 1) : 0;
+        dy_ = dom.nup > 1 ? (dom.upper_right.imag() - dom.lower_left.imag()) /
+                            (dom.nup - 1) : 0;
+    }
+
+    void tile(unsigned i0, unsigned i1, unsigned j0, unsigned j1)
+    {
+        const double x0 = dom_.lower_left.real(), y0 = dom_.lower_left.imag();
+        const std::complex<double> center(x0 + (j0 + j1 - 1) * 0.5 * dx_,
+                                          y0 + (i0 + i1 - 1) * 0.5 * dy_);
+        const double radius = 0.5 * std::hypot((j1 - j0 - 1) * double(dx_),
+                                               (i1 - i0 - 1) * double(dy_));
+        const ExteriorEstimate e = estimate_exterior(f_, center, escape_,
+                                                     max_iters_);
+        if (e.iters != 0 && radius <= e.distance / 4) {
+            for (unsigned i = i0; i < i1; ++i)
+                for (unsigned j = j0; j < j1; ++j)
+                    out_[i*out_.stride() + j] = extrapolate(
+                        e, std::complex<double>(x0 + j*dx_, y0 + i*dy_) -
+                           center);
+            return;
+        }
+
+        // Points that don't escape are most likely in the set, and then so
+        // are parts of all four quarters; and disks much smaller than the
+        // tile won't grow enough for any of them.
+        if (e.iters == 0 || e.distance < radius / 8 ||
+            i1 - i0 < 2*min_distance_tile || j1 - j0 < 2*min_distance_tile) {
+            for (unsigned i = i0; i < i1; ++i)
+                kernel_(cmplx(dom_.lower_left.real() + j0*dx_,
+                              dom_.lower_left.imag() + i*dy_),
+                        dx_, j1 - j0, &out_[i*out_.stride() + j0]);
+            return;
+        }
+        const unsigned im = (i0 + i1) / 2, jm = (j0 + j1) / 2;
+        tile(i0, im, j0, jm);
+        tile(i0, im, jm, j1);
+        tile(im, i1, j0, jm);
+        tile(im, i1, jm, j1);
+    }
+
+private:
+    const Domain<cmplx>& dom_;
+    vector_slice<unsigned>& out_;
+    const Kernel& kernel_;
+    const fn_parser::DualProgram<std::complex<double>>& f_;
+    double escape_;
+    unsigned max_iters_;
+    real dx_;
+    real dy_;
+
+    // Escape time at offset 'h' from the point estimated by 'e'.
+    unsigned extrapolate(const ExteriorEstimate& e,
+                         const std::complex<double>& h) const
+    {
+        // z_k(c + h) ~ z_k(c) + dz_k/dc h, which is close enough around
+        // iteration 'iters' for the escape time to be that of the center
+        // or one or two off.
+        const int w = exterior_window;
+        auto escaped = [&](int k)
+        {
+            if (k < 0 || (k < w && unsigned(w - k) > e.iters))
+                return false;
+            if (k >= e.known)
+                return true;
+            return std::norm(e.z[k] + e.dz[k]*h) >= escape_*escape_;
+        };
+        int k = w;
+        if (escaped(k))
+            while (escaped(k - 1))
+                --k;
+        else
+            while (!escaped(k))
+                ++k;
+        const unsigned n = e.iters + k - w;
+        if (n < 1)
+            return 1;
+        return n >= max_iters_ ? 0 : n;
+    }
+};
+
+}
+
+template <typename cmplx, typename Kernel>
+void distance_fill(const Domain<cmplx>& dom, vector_slice<unsigned>& out,
+                   const Kernel& kernel,
+                   const fn_parser::DualProgram<std::complex<double>>& f,
+                   double escape, unsigned max_iters,
+                   unsigned i0, unsigned i1, unsigned j0, unsigned j1)
+{
+    DistanceFill<cmplx, Kernel> fill(dom, out, kernel, f, escape, max_iters);
+    for (unsigned i = i0; i < i1; i += max_distance_tile)
+        for (unsigned j = j0; j < j1; j += max_distance_tile)
+            fill.tile(i, std::min(i + max_distance_tile, i1),
+                      j, std::min(j + max_distance_tile, j1));
+}
+
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+/*
+ * Forward mode automatic differentiation of a bytecode Program.
+ *
+ * A Dual carries a value together with its derivatives with respect to two
+ * inputs, z and c. DualProgram runs the instructions of a Program on Duals,
+ * applying the chain rule as it goes, so one evaluation gives f(z, c),
+ * df/dz and df/dc. Seeding z with dz = 1 and c with dc = 1 gives the
+ * derivatives of a single step of the function; feeding the result back in
+ * as the next z gives the derivatives of the n-th iterate with respect to
+ * the starting z and c, as needed for distance estimates or interior and
+ * convergence tests.
+ *
+ * Functions like z^2 + c are holomorphic and their derivatives are ordinary
+ * complex numbers, but conj, abs, real and imag aren't. So that formulas like
+ * conj(z)^2 + c still get the right answer, derivatives are Wirtinger pairs:
+ * next to d/dz there's d/dconj(z), which is zero as long as everything is
+ * holomorphic. The change in f when z moves by a small h is then
+ *
+ *     dz*h + dz_conj*conj(h)
+ *
+ * and the same for c.
+ */
+
+#include "bytecode.hpp"
+#include "expression.hpp"
+
+#include <complex>
+#include <vector>
+
+namespace fractals {
+
+namespace fn_parser {
+
+template <typename cmplx>
+struct Dual
+{
+    cmplx value;
+    cmplx dz;
+    cmplx dz_conj;
+    cmplx dc;
+    cmplx dc_conj;
+
+    // z and c as inputs, seeded with their own derivatives.
+    static Dual z(const cmplx& v) { return Dual{v, 1, 0, 0, 0}; }
+    static Dual c(const cmplx& v) { return Dual{v, 0, 0, 1, 0}; }
+};
+
+namespace {
+
+    // a*x + b*y on all of the derivatives, with 'value' as the result.
+    template <typename cmplx>
+    Dual<cmplx> combine(const cmplx& value, const cmplx& a,
+                        const Dual<cmplx>& x, const cmplx& b,
+                        const Dual<cmplx>& y)
+    {
+        return Dual<cmplx>{value, a*x.dz + b*y.dz,
+                           a*x.dz_conj + b*y.dz_conj, a*x.dc + b*y.dc,
+                           a*x.dc_conj + b*y.dc_conj};
+    }
+
+    // f(x) for a holomorphic f with derivative 'df' at x.
+    template <typename cmplx>
+    Dual<cmplx> chain(const cmplx& value, const cmplx& df,
+                      const Dual<cmplx>& x)
+    {
+        return Dual<cmplx>{value, df*x.dz, df*x.dz_conj, df*x.dc,
+                           df*x.dc_conj};
+    }
+
+    // a*x + b*conj(x); conj swaps the two halves of each Wirtinger pair.
+    template <typename cmplx>
+    Dual<cmplx> mix_conj(const cmplx& value, const cmplx& a, const cmplx& b,
+                         const Dual<cmplx>& x)
+    {
+        return Dual<cmplx>{value, a*x.dz + b*std::conj(x.dz_conj),
+                           a*x.dz_conj + b*std::conj(x.dz),
+                           a*x.dc + b*std::conj(x.dc_conj),
+                           a*x.dc_conj + b*std::conj(x.dc)};
+    }
+
+}
+
+/*
+ * Apply one operation to Duals. The values are computed as in
+ * Program::run().
+ */
+template <typename cmplx>
+Dual<cmplx> apply(op code, const Dual<cmplx>& a, const Dual<cmplx>& b)
+{
+    using real = typename cmplx::value_type;
+    const cmplx& x = a.value;
+    const cmplx& y = b.value;
+    const cmplx one(1);
+    switch (code) {
+    case op::NEG:
+        return chain(-x, -one, a);
+    case op::ADD:
+        return combine(x + y, one, a, one, b);
+    case op::SUB:
+        return combine(x - y, one, a, -one, b);
+    case op::MUL:
+        return combine(x * y, y, a, x, b);
+    case op::DIV:
+    {
+        cmplx q = x / y;
+        return combine(q, one / y, a, -q / y, b);
+    }
+    case op::POW:
+    {
+        // d(x^y) = y*x^(y-1) dx + x^y*log(x) dy
+        cmplx p = std::pow(x, y);
+        return combine(p, y * std::pow(x, y - one), a, p * std::log(x), b);
+    }
+    case op::SQUARE:
+        return chain(cmplx(x.real() * x.real() - x.imag() * x.imag(),
+                           2 * x.real() * x.imag()), real(2) * x, a);
+    case op::ABS:
+    {
+        // |x| = sqrt(x*conj(x))
+        real r = std::abs(x);
+        cmplx h = r == 0 ? cmplx(0) : std::conj(x) / (2 * r);
+        return mix_conj(cmplx(r), h, std::conj(h), a);
+    }
+    case op::EXP:
+    {
+        cmplx e = std::exp(x);
+        return chain(e, e, a);
+    }
+    case op::SIN:
+        return chain(std::sin(x), std::cos(x), a);
+    case op::COS:
+        return chain(std::cos(x), -std::sin(x), a);
+    case op::TAN:
+    {
+        cmplx t = std::tan(x);
+        return chain(t, one + t * t, a);
+    }
+    case op::ASIN:
+        return chain(std::asin(x), one / std::sqrt(one - x * x), a);
+    case op::ACOS:
+        return chain(std::acos(x), -one / std::sqrt(one - x * x), a);
+    case op::ATAN:
+        return chain(std::atan(x), one / (one + x * x), a);
+    case op::SQRT:
+    {
+        cmplx s = std::sqrt(x);
+        return chain(s, one / (real(2) * s), a);
+    }
+    case op::REAL:
+        // (x + conj(x))/2
+        return mix_conj(cmplx(x.real()), cmplx(0.5), cmplx(0.5), a);
+    case op::IMAG:
+        // i*Im(x) = (x - conj(x))/2
+        return mix_conj(cmplx(0, x.imag()), cmplx(0.5), cmplx(-0.5), a);
+    case op::CONJ:
+        return mix_conj(std::conj(x), cmplx(0), one, a);
+    default:
+        return a;
+    }
+}
+
+/*
+ * A Program evaluated on Duals. Uses the same instructions and register
+ * layout as the Program it's made from.
+ */
+template <typename cmplx>
+class DualProgram
+{
+public:
+    DualProgram() = default;
+
+    explicit DualProgram(const Program<cmplx>& prog) : prog_(prog)
+    {
+        for (const cmplx& v : prog.initial_registers())
+            initial_.push_back(Dual<cmplx>{v, 0, 0, 0, 0});
+    }
+
+    const Program<cmplx>& program() const { return prog_; }
+
+    Dual<cmplx> operator()(const Dual<cmplx>& z, const Dual<cmplx>& c) const
+    {
+        using P = Program<cmplx>;
+        RegisterFile<Dual<cmplx>> regs(initial_);
+        regs[P::z_register] = z;
+        regs[P::c_register] = c;
+        for (const Instruction& ins : prog_.instructions())
+            regs[ins.dst] = apply(ins.code, regs[ins.a], regs[ins.b]);
+        return regs[prog_.result_register()];
+    }
+
+    // f(z, c) and its derivatives with respect to z and c.
+    Dual<cmplx> operator()(const cmplx& z, const cmplx& c) const
+    {
+        return (*this)(Dual<cmplx>::z(z), Dual<cmplx>::c(c));
+    }
+
+private:
+    Program<cmplx> prog_;
+    std::vector<Dual<cmplx>> initial_;
+};
+
+}
+
+}
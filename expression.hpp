@@ -0,0 +1,132 @@
+#pragma once
+
+/*
+ * Intermediate representation of a parsed function f(z, c). The parser in
+ * function_parser.hpp builds one of these and the different back ends
+ * (std::function closures, bytecode) are generated from it.
+ *
+ * An Expression is a flat pool of nodes. Operands of a node are referenced by
+ * their index in the pool and always come before the node that uses them, so
+ * walking the pool from front to back visits every node after its operands.
+ *
+ * Nodes are hash-consed: adding a node identical to one already in the pool
+ * returns the existing one instead, so a subexpression that appears several
+ * times in a function, as z^2 does in (z^2 + c)/(z^2 - c), becomes a single
+ * node with several users and the pool is a DAG rather than a tree. The back
+ * ends generate code for each node once, so repeated terms are only
+ * evaluated once per iteration. The operands of + and * are put in a fixed
+ * order first so that a*b and b*a are also shared.
+ */
+
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace fractals {
+
+namespace fn_parser {
+
+enum class op {
+    CONSTANT, Z, C,
+    NEG, ADD, SUB, MUL, DIV, POW, SQUARE,
+    ABS, EXP, SIN, COS, TAN, ASIN, ACOS, ATAN, SQRT, REAL, IMAG, CONJ
+};
+
+// Number of operands taken by each kind of node.
+inline unsigned arity(op code)
+{
+    switch (code) {
+    case op::CONSTANT:
+    case op::Z:
+    case op::C:
+        return 0;
+    case op::ADD:
+    case op::SUB:
+    case op::MUL:
+    case op::DIV:
+    case op::POW:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+struct Node
+{
+    op code;
+    unsigned lhs;
+    unsigned rhs;
+    // Only meaningful for op::CONSTANT. Constants are stored in double
+    // precision and converted when a back end is instantiated.
+    std::complex<double> value;
+};
+
+class Expression
+{
+public:
+    const std::vector<Node>& nodes() const { return nodes_; }
+    const Node& operator[](unsigned i) const { return nodes_[i]; }
+    unsigned size() const { return nodes_.size(); }
+
+    // Index of the node giving the value of the whole expression.
+    unsigned root() const { return root_; }
+    void set_root(unsigned r) { root_ = r; }
+
+    unsigned add_constant(const std::complex<double>& v)
+    {
+        return add(Node{op::CONSTANT, 0, 0, v});
+    }
+
+    unsigned add_variable(op code)
+    {
+        return add(Node{code, 0, 0, 0.0});
+    }
+
+    unsigned add_unary(op code, unsigned arg)
+    {
+        return add(Node{code, arg, 0, 0.0});
+    }
+
+    unsigned add_binary(op code, unsigned lhs, unsigned rhs)
+    {
+        if ((code == op::ADD || code == op::MUL) && rhs < lhs)
+            std::swap(lhs, rhs);
+        return add(Node{code, lhs, rhs, 0.0});
+    }
+
+private:
+    // Constants are compared by their bit patterns, so 0 and -0 stay
+    // distinct and NaNs don't upset the ordering.
+    using Key = std::tuple<op, unsigned, unsigned, std::uint64_t, std::uint64_t>;
+
+    static std::uint64_t bits(double x)
+    {
+        std::uint64_t b;
+        std::memcpy(&b, &x, sizeof b);
+        return b;
+    }
+
+    unsigned add(const Node& n)
+    {
+        Key key(n.code, n.lhs, n.rhs, bits(n.value.real()),
+                bits(n.value.imag()));
+        auto found = index_.find(key);
+        if (found != index_.end())
+            return found->second;
+        nodes_.push_back(n);
+        index_.emplace(key, nodes_.size() - 1);
+        return nodes_.size() - 1;
+    }
+
+    std::vector<Node> nodes_;
+    std::map<Key, unsigned> index_;
+    unsigned root_ = 0;
+};
+
+}
+
+}
@@ -6,18 +6,22 @@
  */
 
 #include "qdbmp.h"
+#include "scheduler.hpp"
+#include "thread_pool.hpp"
 #include "vector_slice.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
 
 namespace fractals
 {
 
-// Heuristic; determines how many pixels in the resulting image each thread
-// will be responsible for.
-constexpr unsigned points_per_thread = 100000;
-
 /*
  * This struct represents a region in the complex plane; the two complex
  * numbers 'lower_left' and 'upper_right' describe the rectangle comprising
@@ -37,85 +41,149 @@ struct Domain
         lower_left(ll), upper_right(ur), nacross(na), nup(nu) {}
 };
 
+/*
+ * An allocator that default-initializes new elements instead of
+ * value-initializing them, so that a vector of a trivial type can be
+ * resized without writing to it. Memory is placed on the NUMA node of the
+ * thread that first writes it, so the values of an image are left for the
+ * threads computing them to write first.
+ */
+template <typename T>
+struct default_init_allocator : std::allocator<T>
+{
+    template <typename U>
+    struct rebind
+    {
+        using other = default_init_allocator<U>;
+    };
+
+    default_init_allocator() = default;
+    template <typename U>
+    default_init_allocator(const default_init_allocator<U>&) {}
+
+    template <typename U>
+    void construct(U* p)
+    {
+        ::new (static_cast<void*>(p)) U;
+    }
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
 /*
  * A Fractal is a domain along with an array of values corresponding to
  * each point in the domain. Values are given in row-major order and 
  * increasing in both the real and imaginary directions (so left->right and
- * bottom->top).
+ * bottom->top). They're normally iteration counts, but can be anything
+ * computed per point (e.g. colors, see supersample.hpp).
  */
-template <typename cmplx>
+template <typename cmplx, typename T = unsigned>
 struct Fractal
 {
+    using storage = std::vector<T, default_init_allocator<T>>;
+
+    // Tag for leaving the values unset, to be filled in by make_fractal.
+    struct uninitialized {};
+
     Domain<cmplx> dom;
-    std::vector<unsigned> values;
+    storage values;
 
     Fractal(const Domain<cmplx>& d) : dom(d)
+    {
+        values.resize(dom.nacross * dom.nup, T());
+    }
+
+    Fractal(const Domain<cmplx>& d, uninitialized) : dom(d)
     {
         values.resize(dom.nacross * dom.nup);
     }
 };
 
-// Acquire/release the mutex for domain decomposition.
-void lock_decomposition_mutex();
-void unlock_decomposition_mutex();
-
-// Get the beginning of the next domain to assign work.
-unsigned& get_domain_start();
-
 /*
- * For internal use only. Given the input domain and a reference to the values
- * array of a target fractal object, finds the next domain that the thread 
- * will be responsible for computing. 'target' is filled with this data and 
- * 'output' becomes a vector_slice that is a window into the correct region in
- * 'vals'.
+ * For internal use only. The part of 'dom' covered by 'tile'.
  */
 template <typename cmplx>
-bool decompose_domain(const Domain<cmplx>& dom, Domain<cmplx>& target,
-                      std::vector<unsigned>& vals, 
-                      vector_slice<unsigned>& output)
+Domain<cmplx> tile_domain(const Domain<cmplx>& dom, const Tile& tile)
 {
-    unsigned& dom_start = get_domain_start();
-    if (dom_start >= dom.nup)
-        return true;
-
-    const unsigned first_row = dom_start;
-    dom_start += (points_per_thread / dom.nacross + 1);
-    const unsigned last_row = dom_start < dom.nup ? dom_start : dom.nup;
-
-    typename cmplx::value_type dy = 
-        (dom.upper_right.imag() - dom.lower_left.imag()) /
-        (dom.nup - 1);
-
-    target.lower_left = dom.lower_left + cmplx(0.0, dy * first_row);
-    target.upper_right = cmplx(dom.upper_right.real(), 
-            dy*(last_row - 1) + dom.lower_left.imag());
-    target.nacross = dom.nacross;
-    target.nup = last_row - first_row;
-    output = vector_slice<unsigned>(vals, first_row*dom.nacross);
-    return false;
+    using real = typename cmplx::value_type;
+    const real dx = dom.nacross > 1 ?
+        (dom.upper_right.real() - dom.lower_left.real()) / (dom.nacross - 1) : 0;
+    const real dy = dom.nup > 1 ?
+        (dom.upper_right.imag() - dom.lower_left.imag()) / (dom.nup - 1) : 0;
+    // The edges of the image are kept exact.
+    const real right = tile.j1 == dom.nacross ? dom.upper_right.real() :
+                       dom.lower_left.real() + dx * (tile.j1 - 1);
+    const real top = tile.i1 == dom.nup ? dom.upper_right.imag() :
+                     dom.lower_left.imag() + dy * (tile.i1 - 1);
+    return Domain<cmplx>(dom.lower_left + cmplx(dx * tile.j0, dy * tile.i0),
+                         cmplx(right, top), tile.j1 - tile.j0,
+                         tile.i1 - tile.i0);
 }
 
 /*
- * For internal use only; given the overall domain and the overall array of
- * values, as well as a function that checks points in a domain, get a slice
- * of work to do and do it repeatedly until we're done.
+ * For internal use only; given the overall domain, the scheduler handing out
+ * its tiles and the overall array of values, as well as a function that
+ * checks points in a domain, get a tile of work to do and do it repeatedly
+ * until we're done. 'w' is the number of the worker running this.
  */
-template <typename cmplx, typename Check>
-void check_points_thread(const Domain<cmplx>& dom, std::vector<unsigned>& vals,
-                         const Check& chk)
+template <typename cmplx, typename Values, typename Check>
+void check_points_thread(const Domain<cmplx>& dom, TileScheduler& sched,
+                         unsigned w, Values& vals, const Check& chk)
 {
-    while (true) {
-        Domain<cmplx> this_dom;
-        vector_slice<unsigned> my_slice;
+    // The checker writes the tile in place, through a slice with the
+    // image's rows as its stride. make_fractal leaves the image unwritten,
+    // so the pages of the tiles this thread computes first are placed in its
+    // memory (a page shared with a neighbouring tile goes to whichever
+    // thread writes it first).
+    using T = typename Values::value_type;
+    Tile tile;
+    while (sched.next(w, tile)) {
+        vector_slice<T> slice(vals, tile.i0*dom.nacross + tile.j0,
+                              dom.nacross);
+        chk(tile_domain(dom, tile), slice);
+        sched.finished();
+    }
+}
 
-        lock_decomposition_mutex();
-        bool done = decompose_domain(dom, this_dom, vals, my_slice);
-        unlock_decomposition_mutex();
+/*
+ * For internal use only. Estimate the cost of computing each of 'tiles' of
+ * 'dom' with 'chk' by timing it on every cost_sample_step-th point of the
+ * tile, using the threads of 'pool'.
+ */
+template <typename T, typename cmplx, typename Check>
+std::vector<double> estimate_costs(const Domain<cmplx>& dom,
+                                   const std::vector<Tile>& tiles,
+                                   const Check& chk, ThreadPool& pool)
+{
+    // At least the corners, so the points are spread over the tile.
+    auto samples = [](unsigned n)
+    {
+        return std::min(n, std::max(2u, (n - 1) / cost_sample_step + 1));
+    };
 
-        if (done) 
-            break;
-        chk(this_dom, my_slice);
-    }
+    std::vector<double> costs(tiles.size());
+    std::atomic<unsigned> next{0};
+    pool.run([&](unsigned)
+    {
+        std::vector<T> buf;
+        for (unsigned k = next++; k < tiles.size(); k = next++) {
+            const Domain<cmplx> part = tile_domain(dom, tiles[k]);
+            const Domain<cmplx> sample(part.lower_left, part.upper_right,
+                                       samples(part.nacross),
+                                       samples(part.nup));
+            buf.resize(sample.nacross * sample.nup);
+            vector_slice<T> slice(buf, 0, sample.nacross);
+            const auto start = std::chrono::steady_clock::now();
+            chk(sample, slice);
+            const std::chrono::duration<double> took =
+                std::chrono::steady_clock::now() - start;
+            costs[k] = took.count() * part.nacross * part.nup / buf.size();
+        }
+    });
+    return costs;
 }
 
 /*
@@ -127,34 +195,60 @@ void check_points_thread(const Domain<cmplx>& dom, std::vector<unsigned>& vals,
  * 
  * and should fill values in the slice given in row major order increasing
  * in both the real and imaginary dimension (as described above in comments
- * on the Fractal format).
+ * on the Fractal format). The domains given are tiles of the whole one (see
+ * scheduler.hpp), and the slice is the tile's window onto the image: the
+ * value of point (i, j) of the tile goes to slice[i*slice.stride() + j].
+ * For values other than iteration counts, give their type as the template
+ * argument T and take a vector_slice<T>.
  *
  * The optional argument num_threads simply specifies how many threads are 
- * to be used by the routine. As long as the heuristic 'points_per_thread'
- * defined above is good work will be distributed quite evenly, resulting 
+ * to be used by the routine. Tiles are split and moved between threads as
+ * they run out of work, so the work is distributed quite evenly, resulting
  * in a nearly-linear speedup up to the number of cores on your machine.
+ * Calls don't share any state, so several can run at once from different
+ * threads (each with its own threads).
+ *
+ * To render many images, start a ThreadPool (see thread_pool.hpp) once and
+ * pass it instead of num_threads, so the threads are reused. With a pool,
+ * 'how' can also ask for the tiles to be given out statically by their
+ * estimated cost instead of by work stealing (see scheduler.hpp).
  */
-template <typename cmplx, typename Check>
-Fractal<cmplx> make_fractal(const Domain<cmplx>& dom, const Check& chk, 
-                            unsigned num_threads = 1)
+template <typename T = unsigned, typename cmplx, typename Check>
+Fractal<cmplx, T> make_fractal(const Domain<cmplx>& dom, const Check& chk,
+                               ThreadPool& pool,
+                               schedule how = schedule::stealing)
 {
-    using std::thread;
-    std::vector<std::thread> threads;
-    Fractal<cmplx> f(dom);
-
-    auto check_points = [&] ()
+    Fractal<cmplx, T> f(dom, typename Fractal<cmplx, T>::uninitialized());
+    auto run = [&](TileScheduler& sched)
     {
-        check_points_thread(dom, f.values, chk);
+        pool.run([&](unsigned w)
+        {
+            check_points_thread(dom, sched, w, f.values, chk);
+        });
     };
 
-    for (unsigned tid = 0; tid < num_threads; ++tid) {
-        threads.push_back(thread(check_points)); 
+    if (how == schedule::cost) {
+        const std::vector<Tile> tiles = cut_into_tiles(
+            dom.nacross, dom.nup,
+            balanced_tile_size(dom.nacross, dom.nup, pool.size()));
+        TileScheduler sched(tiles, estimate_costs<T>(dom, tiles, chk, pool),
+                            pool.size());
+        run(sched);
+    } else {
+        TileScheduler sched(dom.nacross, dom.nup, pool.size());
+        run(sched);
     }
-    for (auto& thr: threads)
-        thr.join();
     return f;
 }
 
+template <typename T = unsigned, typename cmplx, typename Check>
+Fractal<cmplx, T> make_fractal(const Domain<cmplx>& dom, const Check& chk, 
+                               unsigned num_threads = 1)
+{
+    ThreadPool pool(num_threads);
+    return make_fractal<T>(dom, chk, pool);
+}
+
 struct Color
 {
     unsigned char r;
@@ -167,13 +261,14 @@ struct Color
  * given should map unsigned integers from 0 - whatever max iterations you're 
  * using into an RGB color scale and should have the signature
  *     void calc_color(unsigned iters, Color& clr);
+ * (or take the value type of the fractal instead of unsigned).
  *
  * If the C library I'm using to write the bitmap encounters an error I simply
  * throw the description of the error as an exception and make no attempt to
  * recover.
  */
-template <typename cmplx, typename F>
-void save_fractal_img(const Fractal<cmplx>& frac, FILE* f,
+template <typename cmplx, typename T, typename F>
+void save_fractal_img(const Fractal<cmplx, T>& frac, FILE* f,
                       const F& calc_color)
 {
     unsigned width, height;
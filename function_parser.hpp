@@ -1,5 +1,10 @@
 #pragma once
 
+#include "bytecode.hpp"
+#include "dual.hpp"
+#include "expression.hpp"
+#include "simplify.hpp"
+
 #include <complex>
 #include <exception>
 #include <functional>
@@ -24,6 +29,15 @@ namespace {
     
 }
 
+/*
+ * Parses a function of z and c into an Expression, which is then folded and
+ * simplified (see simplify.hpp). The result can be retrieved as the
+ * Expression itself, "compiled" to a std::function built from closures (get)
+ * or compiled to a bytecode Program (get_program), which can also be run
+ * with derivatives (get_dual_program, see dual.hpp). Only the Program
+ * evaluates a repeated subexpression once; the closures follow the expression
+ * as a tree.
+ */
 class FunctionParser
 {
 public:
@@ -32,36 +46,42 @@ public:
     template <typename cmplx = std::complex<double>>
     fn<cmplx> get();
 
+    template <typename cmplx = std::complex<double>>
+    Program<cmplx> get_program();
+
+    template <typename cmplx = std::complex<double>>
+    DualProgram<cmplx> get_dual_program();
+
+    const Expression& get_expression();
+
 private:
     std::istringstream stream;
+    Expression expr;
+    bool parsed = false;
 
-    template <typename cmplx>
-    fn<cmplx> parse_expr();
+    unsigned parse_expr();
 
-    template <typename cmplx>
-    fn<cmplx> parse_lvl0_term();
+    unsigned parse_lvl0_term();
 
-    template <typename cmplx>
-    fn<cmplx> parse_lvl1_term();
+    unsigned parse_lvl1_term();
 
-    template <typename cmplx>
-    fn<cmplx> parse_factor();
+    unsigned parse_factor();
 
-    template <typename cmplx>
-    fn<cmplx> parse_number_or_fn();
+    unsigned parse_number_or_fn();
 
-    template <typename cmplx>
-    fn<cmplx> parse_function();
+    unsigned parse_function();
+
+    unsigned parse_number();
 
     template <typename cmplx>
-    fn<cmplx> parse_number();
+    fn<cmplx> build_fn(unsigned node) const;
 
     enum class operators {
         PLUS, MINUS, MUL, DIV, EXPONENT
     };
 
     enum class functions {
-        ABS, EXP, SIN, COS, TAN, ASIN, ACOS, ATAN, SQRT, REAL, IMAG,
+        ABS, EXP, SIN, COS, TAN, ASIN, ACOS, ATAN, SQRT, REAL, IMAG, CONJ,
         CONSTANT
     };
 
@@ -87,64 +107,77 @@ private:
 
 inline FunctionParser::FunctionParser(const std::string& str) : stream(str) {}
 
+inline const Expression& FunctionParser::get_expression()
+{
+    if (!parsed) {
+        expr.set_root(parse_expr());
+        expr = simplify(expr);
+        parsed = true;
+    }
+    return expr;
+}
+
 template <typename cmplx>
 inline fn<cmplx> FunctionParser::get()
 {
-    return parse_expr<cmplx>();
+    return build_fn<cmplx>(get_expression().root());
 }
 
 template <typename cmplx>
-inline fn<cmplx> FunctionParser::parse_expr()
+inline Program<cmplx> FunctionParser::get_program()
 {
-    auto f = parse_lvl0_term<cmplx>();
+    return Program<cmplx>(get_expression());
+}
+
+template <typename cmplx>
+inline DualProgram<cmplx> FunctionParser::get_dual_program()
+{
+    return DualProgram<cmplx>(get_program<cmplx>());
+}
+
+inline unsigned FunctionParser::parse_expr()
+{
+    auto f = parse_lvl0_term();
     skip_whitespace(stream);
     
     while (stream.peek() == '+' || stream.peek() == '-') {
-        auto op = stream.get() == '+' ? operators::PLUS : operators::MINUS;
-        auto g = parse_lvl0_term<cmplx>();
-        if (op == operators::PLUS) {
-            f = [=](const cmplx& z, const cmplx& c) {
-                return f(z, c) + g(z, c);
-            };
-        } else {
-            f = [=](const cmplx& z, const cmplx& c) {
-                return f(z, c) - g(z, c);
-            };
-        }
+        auto oper = stream.get() == '+' ? operators::PLUS : operators::MINUS;
+        auto g = parse_lvl0_term();
+        if (oper == operators::PLUS)
+            f = expr.add_binary(op::ADD, f, g);
+        else
+            f = expr.add_binary(op::SUB, f, g);
         skip_whitespace(stream);
     }
     return f;
 }
 
-template <typename cmplx>
-inline fn<cmplx> FunctionParser::parse_lvl0_term()
+inline unsigned FunctionParser::parse_lvl0_term()
 {
-    auto f = parse_lvl1_term<cmplx>();
+    auto f = parse_lvl1_term();
     skip_whitespace(stream);
 
     while (stream.peek() == '*' || stream.peek() == '/') {
-        auto op = stream.get() == '*' ? operators::MUL : operators::DIV;
-        auto g = parse_lvl1_term<cmplx>();
-        if (op == operators::MUL) {
-            f = [=](const cmplx& z, const cmplx& c){ return f(z, c) * g(z, c); };
-        } else {
-            f = [=](const cmplx& z, const cmplx& c){ return f(z, c) / g(z, c); };
-        }
+        auto oper = stream.get() == '*' ? operators::MUL : operators::DIV;
+        auto g = parse_lvl1_term();
+        if (oper == operators::MUL)
+            f = expr.add_binary(op::MUL, f, g);
+        else
+            f = expr.add_binary(op::DIV, f, g);
         skip_whitespace(stream);
     }
     return f;
 }
 
-template <typename cmplx>
-inline fn<cmplx> FunctionParser::parse_lvl1_term()
+inline unsigned FunctionParser::parse_lvl1_term()
 {
-    auto f = parse_factor<cmplx>();
+    auto f = parse_factor();
     skip_whitespace(stream);
 
     while (stream.peek() == '^') {
         stream.get();
-        auto g = parse_factor<cmplx>();
-        f = [=](const cmplx& z, const cmplx& c) { return std::pow(f(z, c), g(z, c)); };
+        auto g = parse_factor();
+        f = expr.add_binary(op::POW, f, g);
         skip_whitespace(stream);
     }
     return f;
@@ -188,51 +221,55 @@ struct constant_fn
     }
 };
 
-template <typename cmplx>
-inline fn<cmplx> FunctionParser::parse_factor()
+inline unsigned FunctionParser::parse_factor()
 {
     skip_whitespace(stream);
     switch (stream.peek()) {
     case '+':
     case '-':
     {
-        auto op = parse_plus_or_minus();
-        auto f = parse_factor<cmplx>();
-        if (op == operators::MINUS)
-            f = [=](const cmplx& z, const cmplx& c){ return -f(z, c); };
+        auto oper = parse_plus_or_minus();
+        auto f = parse_factor();
+        if (oper == operators::MINUS)
+            f = expr.add_unary(op::NEG, f);
         return f;
     }
     case 'I':
         stream.get();
-        return imaginary_unit<cmplx>{};
+        return expr.add_constant(std::complex<double>(0, 1));
     case 'z':
         stream.get();
-        return identity_fn_z<cmplx>{};
+        return expr.add_variable(op::Z);
     case '(':
+    {
         stream.get();
-        return parse_expr<cmplx>();
+        auto f = parse_expr();
+        skip_whitespace(stream);
+        if (stream.peek() != ')')
+            throw ParseException{};
+        stream.get();
+        return f;
+    }
     default:
-        return parse_number_or_fn<cmplx>();
+        return parse_number_or_fn();
     }
 }
 
-template <typename cmplx>
-inline fn<cmplx> FunctionParser::parse_number_or_fn()
+inline unsigned FunctionParser::parse_number_or_fn()
 {
     char c = stream.peek();
     if ((c >= '0' && c <= '9') || c == '.') {
-        return parse_number<cmplx>();
+        return parse_number();
     } else {
-        return parse_function<cmplx>();
+        return parse_function();
     }
 }
 
-template <typename cmplx>
-inline fn<cmplx> FunctionParser::parse_number()
+inline unsigned FunctionParser::parse_number()
 {
-    typename cmplx::value_type x;
+    double x;
     stream >> x;
-    return constant_fn<cmplx>(x);
+    return expr.add_constant(x);
 }
 
 inline FunctionParser::functions FunctionParser::get_function_name()
@@ -271,7 +308,11 @@ inline FunctionParser::functions FunctionParser::get_function_name()
     case 'c':
         if (stream.peek() != 'o')
             return functions::CONSTANT;
-        stream.get(); stream.get();
+        stream.get();
+        if (stream.get() == 'n') {
+            stream.get();
+            return functions::CONJ;
+        }
         return functions::COS;
     case 't':
         stream.get(); stream.get();
@@ -287,17 +328,16 @@ inline FunctionParser::functions FunctionParser::get_function_name()
     }
 }
 
-template <typename cmplx>
-inline fn<cmplx> FunctionParser::parse_function()
+inline unsigned FunctionParser::parse_function()
 {
     functions fn_name = get_function_name();
     if (fn_name == functions::CONSTANT)
-        return identity_fn_c<cmplx>{};
+        return expr.add_variable(op::C);
     skip_whitespace(stream);
     if (stream.peek() != '(')
         throw ParseException{};
     stream.get();
-    auto f = parse_expr<cmplx>();
+    auto f = parse_expr();
     skip_whitespace(stream);
     if (stream.peek() != ')')
         throw ParseException{};
@@ -305,35 +345,111 @@ inline fn<cmplx> FunctionParser::parse_function()
 
     switch (fn_name) {
     case functions::ABS:
+        return expr.add_unary(op::ABS, f);
+    case functions::EXP:
+        return expr.add_unary(op::EXP, f);
+    case functions::SIN:
+        return expr.add_unary(op::SIN, f);
+    case functions::COS:
+        return expr.add_unary(op::COS, f);
+    case functions::TAN:
+        return expr.add_unary(op::TAN, f);
+    case functions::ASIN:
+        return expr.add_unary(op::ASIN, f);
+    case functions::ACOS:
+        return expr.add_unary(op::ACOS, f);
+    case functions::ATAN:
+        return expr.add_unary(op::ATAN, f);
+    case functions::SQRT:
+        return expr.add_unary(op::SQRT, f);
+    case functions::REAL:
+        return expr.add_unary(op::REAL, f);
+    case functions::CONJ:
+        return expr.add_unary(op::CONJ, f);
+    default:
+        return expr.add_unary(op::IMAG, f);
+    }
+}
+
+/*
+ * Recursively build a std::function from closures for the subexpression
+ * rooted at 'node'.
+ */
+template <typename cmplx>
+inline fn<cmplx> FunctionParser::build_fn(unsigned node) const
+{
+    const Node& n = expr[node];
+    fn<cmplx> f, g;
+    if (arity(n.code) > 0)
+        f = build_fn<cmplx>(n.lhs);
+    if (arity(n.code) > 1)
+        g = build_fn<cmplx>(n.rhs);
+
+    switch (n.code) {
+    case op::CONSTANT:
+        if (n.value == std::complex<double>(0, 1))
+            return imaginary_unit<cmplx>{};
+        return constant_fn<cmplx>(cmplx(n.value.real(), n.value.imag()));
+    case op::Z:
+        return identity_fn_z<cmplx>{};
+    case op::C:
+        return identity_fn_c<cmplx>{};
+    case op::NEG:
+        return [=](const cmplx& z, const cmplx& c){ return -f(z, c); };
+    case op::ADD:
+        return [=](const cmplx& z, const cmplx& c) {
+            return f(z, c) + g(z, c);
+        };
+    case op::SUB:
+        return [=](const cmplx& z, const cmplx& c) {
+            return f(z, c) - g(z, c);
+        };
+    case op::MUL:
+        return [=](const cmplx& z, const cmplx& c){ return f(z, c) * g(z, c); };
+    case op::DIV:
+        return [=](const cmplx& z, const cmplx& c){ return f(z, c) / g(z, c); };
+    case op::POW:
+        return [=](const cmplx& z, const cmplx& c) { return std::pow(f(z, c), g(z, c)); };
+    case op::SQUARE:
+        return [=](const cmplx& z, const cmplx& c)
+        {
+            cmplx w = f(z, c);
+            return cmplx(w.real() * w.real() - w.imag() * w.imag(),
+                         2 * w.real() * w.imag());
+        };
+    case op::ABS:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::abs(f(z, c)); };
-    case functions::EXP:
+    case op::EXP:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::exp(f(z, c)); };
-    case functions::SIN:
+    case op::SIN:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::sin(f(z, c)); };
-    case functions::COS:
+    case op::COS:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::cos(f(z, c)); };
-    case functions::TAN:
+    case op::TAN:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::tan(f(z, c)); };
-    case functions::ASIN:
+    case op::ASIN:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::asin(f(z, c)); };
-    case functions::ACOS:
+    case op::ACOS:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::acos(f(z, c)); };
-    case functions::ATAN:
+    case op::ATAN:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::atan(f(z, c)); };
-    case functions::SQRT:
+    case op::SQRT:
         return [=](const cmplx& z, const cmplx& c) 
             { return std::sqrt(f(z, c)); };
-    case functions::REAL:
+    case op::REAL:
         return [=](const cmplx& z, const cmplx& c) 
             { return cmplx(f(z, c).real()); };
+    case op::CONJ:
+        return [=](const cmplx& z, const cmplx& c)
+            { return std::conj(f(z, c)); };
     default:
         return [=](const cmplx& z, const cmplx& c) 
             { return cmplx(0, f(z, c).imag()); };
@@ -342,4 +458,4 @@ inline fn<cmplx> FunctionParser::parse_function()
 
 }
 
-}
\ No newline at end of file
+}
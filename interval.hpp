@@ -0,0 +1,343 @@
+#pragma once
+
+/*
+ * Interval arithmetic evaluation of a bytecode Program, used to settle
+ * whole rectangles of the domain at once.
+ *
+ * A Box is a rectangle in the complex plane, a pair of real intervals. Each
+ * operation maps boxes to a box containing every value the operation can
+ * take on points of its operands. Iterating the function on the box of all
+ * test points in a tile therefore gives, at every step, a box containing
+ * every orbit. If for each n < k those boxes lie inside the escape circle and
+ * the k-th one lies outside it, every point in the tile escapes after exactly
+ * k iterations and none of them needs to be iterated on its own. If instead a
+ * box is mapped into itself without ever leaving the circle, none of the
+ * orbits can ever escape.
+ *
+ * Boxes grow quickly near the boundary of a fractal, where the proof simply
+ * fails and the caller falls back on testing points; far from it (large flat
+ * regions of the exterior) most tiles are settled after a handful of box
+ * iterations.
+ *
+ * Boxes are computed in double precision without directed rounding. To make
+ * up for that, and for the rounding in the point-by-point computation the
+ * result stands in for, a box only counts as inside or outside the escape
+ * circle if it is clear of it by a small relative margin.
+ */
+
+#include "bytecode.hpp"
+#include "expression.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+namespace fractals {
+
+namespace fn_parser {
+
+struct Interval
+{
+    double lo;
+    double hi;
+};
+
+struct Box
+{
+    Interval re;
+    Interval im;
+};
+
+namespace {
+
+    Interval operator+(const Interval& a, const Interval& b)
+    {
+        return Interval{a.lo + b.lo, a.hi + b.hi};
+    }
+
+    Interval operator-(const Interval& a, const Interval& b)
+    {
+        return Interval{a.lo - b.hi, a.hi - b.lo};
+    }
+
+    Interval operator-(const Interval& a)
+    {
+        return Interval{-a.hi, -a.lo};
+    }
+
+    Interval operator*(const Interval& a, const Interval& b)
+    {
+        double p[4] = {a.lo*b.lo, a.lo*b.hi, a.hi*b.lo, a.hi*b.hi};
+        return Interval{*std::min_element(p, p + 4),
+                        *std::max_element(p, p + 4)};
+    }
+
+    Interval operator*(double k, const Interval& a)
+    {
+        return k >= 0 ? Interval{k*a.lo, k*a.hi} : Interval{k*a.hi, k*a.lo};
+    }
+
+    // Tighter than a*a, which doesn't know both factors are the same.
+    Interval square(const Interval& a)
+    {
+        double l = a.lo*a.lo, h = a.hi*a.hi;
+        if (a.lo <= 0 && a.hi >= 0)
+            return Interval{0, std::max(l, h)};
+        return Interval{std::min(l, h), std::max(l, h)};
+    }
+
+    // Requires 'b' not to contain 0.
+    Interval operator/(const Interval& a, const Interval& b)
+    {
+        return a * Interval{1 / b.hi, 1 / b.lo};
+    }
+
+    // exp, cosh and sinh are monotone (cosh on either side of 0).
+    Interval exp(const Interval& a)
+    {
+        return Interval{std::exp(a.lo), std::exp(a.hi)};
+    }
+
+    Interval sinh(const Interval& a)
+    {
+        return Interval{std::sinh(a.lo), std::sinh(a.hi)};
+    }
+
+    Interval cosh(const Interval& a)
+    {
+        Interval s = square(a);
+        return Interval{std::cosh(std::sqrt(s.lo)), std::cosh(std::sqrt(s.hi))};
+    }
+
+    Interval cos(const Interval& a)
+    {
+        const double pi = 3.14159265358979323846;
+        if (a.hi - a.lo >= 2*pi)
+            return Interval{-1, 1};
+        double l = std::cos(a.lo), h = std::cos(a.hi);
+        Interval r{std::min(l, h), std::max(l, h)};
+        // Extremes at multiples of pi inside the interval.
+        double k = std::ceil(a.lo / pi);
+        for (double x = k*pi; x <= a.hi; x += pi, k += 1) {
+            if (std::fmod(std::abs(k), 2.0) == 0)
+                r.hi = 1;
+            else
+                r.lo = -1;
+        }
+        return r;
+    }
+
+    Interval sin(const Interval& a)
+    {
+        const double half_pi = 1.57079632679489661923;
+        return cos(Interval{a.lo - half_pi, a.hi - half_pi});
+    }
+
+    // Range of |z| over a box.
+    Interval modulus(const Box& b)
+    {
+        auto nearest = [](const Interval& a)
+        {
+            return a.lo > 0 ? a.lo : a.hi < 0 ? a.hi : 0.0;
+        };
+        auto farthest = [](const Interval& a)
+        {
+            return std::max(std::abs(a.lo), std::abs(a.hi));
+        };
+        return Interval{std::hypot(nearest(b.re), nearest(b.im)),
+                        std::hypot(farthest(b.re), farthest(b.im))};
+    }
+
+    /*
+     * A box containing op(x, y) for all x in 'a', y in 'b'. Returns false if
+     * there's no useful bound, either because the operation isn't supported
+     * (see interval_supported) or because of a division by a box around 0.
+     */
+    bool apply(op code, const Box& a, const Box& b, Box& out)
+    {
+        const Interval zero{0, 0};
+        switch (code) {
+        case op::NEG:
+            out = Box{-a.re, -a.im};
+            return true;
+        case op::ADD:
+            out = Box{a.re + b.re, a.im + b.im};
+            return true;
+        case op::SUB:
+            out = Box{a.re - b.re, a.im - b.im};
+            return true;
+        case op::MUL:
+            out = Box{a.re*b.re - a.im*b.im, a.re*b.im + a.im*b.re};
+            return true;
+        case op::SQUARE:
+            out = Box{square(a.re) - square(a.im), 2.0*(a.re*a.im)};
+            return true;
+        case op::DIV:
+        {
+            Interval den = square(b.re) + square(b.im);
+            if (!(den.lo > 0))
+                return false;
+            out = Box{(a.re*b.re + a.im*b.im) / den,
+                      (a.im*b.re - a.re*b.im) / den};
+            return true;
+        }
+        case op::ABS:
+            out = Box{modulus(a), zero};
+            return true;
+        case op::EXP:
+        {
+            // e^x (cos y + i sin y)
+            Interval m = exp(a.re);
+            out = Box{m*cos(a.im), m*sin(a.im)};
+            return true;
+        }
+        case op::SIN:
+            // sin x cosh y + i cos x sinh y
+            out = Box{sin(a.re)*cosh(a.im), cos(a.re)*sinh(a.im)};
+            return true;
+        case op::COS:
+            // cos x cosh y - i sin x sinh y
+            out = Box{cos(a.re)*cosh(a.im), -(sin(a.re)*sinh(a.im))};
+            return true;
+        case op::REAL:
+            out = Box{a.re, zero};
+            return true;
+        case op::IMAG:
+            out = Box{zero, a.im};
+            return true;
+        case op::CONJ:
+            out = Box{a.re, -a.im};
+            return true;
+        default:
+            return false;
+        }
+    }
+
+}
+
+// Whether every instruction of a program has an interval version.
+template <typename cmplx>
+bool interval_supported(const Program<cmplx>& prog)
+{
+    for (const Instruction& ins : prog.instructions()) {
+        switch (ins.code) {
+        case op::TAN: case op::ASIN: case op::ACOS: case op::ATAN:
+        case op::SQRT: case op::POW:
+            return false;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+ * Settles rectangles of test points for a program in one of the two modes
+ * of operation (see ctestfun/ztestfun in options.hpp).
+ */
+template <typename cmplx>
+class IntervalTest
+{
+public:
+    using real = typename cmplx::value_type;
+
+    IntervalTest(const Program<cmplx>& prog, const cmplx& constant,
+                 real escape, unsigned max_iters, bool point_is_c) :
+        prog_(prog), constant_(constant), max_iters_(max_iters),
+        point_is_c_(point_is_c)
+    {
+        const double esc2 = double(escape) * double(escape);
+        inside2_ = esc2 * (1 - margin);
+        outside2_ = esc2 * (1 + margin);
+    }
+
+    /*
+     * If every point of the rectangle with the given corners gets the same
+     * result from the escape time loop, returns true and sets 'iters' to it.
+     * Returns false if that couldn't be shown.
+     */
+    bool operator()(const cmplx& lower_left, const cmplx& upper_right,
+                    unsigned& iters) const;
+
+private:
+    // Relative margin on escape^2 for a box to count as inside or outside.
+    static constexpr double margin = 1e-3;
+
+    Program<cmplx> prog_;
+    cmplx constant_;
+    unsigned max_iters_;
+    bool point_is_c_;
+    double inside2_;
+    double outside2_;
+
+    bool run(Box* regs, unsigned first, unsigned last) const
+    {
+        const auto& code = prog_.instructions();
+        for (unsigned i = first; i < last; ++i) {
+            const Instruction& ins = code[i];
+            if (!apply(ins.code, regs[ins.a], regs[ins.b], regs[ins.dst]))
+                return false;
+        }
+        return true;
+    }
+};
+
+template <typename cmplx>
+constexpr double IntervalTest<cmplx>::margin;
+
+template <typename cmplx>
+bool IntervalTest<cmplx>::operator()(const cmplx& lower_left,
+                                     const cmplx& upper_right,
+                                     unsigned& iters) const
+{
+    using P = Program<cmplx>;
+    auto point_box = [](const cmplx& v)
+    {
+        return Box{Interval{double(v.real()), double(v.real())},
+                   Interval{double(v.imag()), double(v.imag())}};
+    };
+
+    std::vector<Box> regs;
+    for (const cmplx& v : prog_.initial_registers())
+        regs.push_back(point_box(v));
+    const Box tile{Interval{double(lower_left.real()),
+                            double(upper_right.real())},
+                   Interval{double(lower_left.imag()),
+                            double(upper_right.imag())}};
+    regs[P::z_register] = point_is_c_ ? point_box(constant_) : tile;
+    regs[P::c_register] = point_is_c_ ? tile : point_box(constant_);
+    if (!run(regs.data(), 0, prog_.setup_size()))
+        return false;
+
+    const auto& code = prog_.instructions();
+    for (unsigned n = 0; n < max_iters_; ++n) {
+        Box& z = regs[P::z_register];
+        Interval r2 = square(z.re) + square(z.im);
+        if (r2.lo >= outside2_) {
+            iters = n;
+            return true;
+        }
+        if (!(r2.hi < inside2_))
+            return false;
+
+        const Box previous = z;
+        if (!run(regs.data(), prog_.setup_size(), code.size()))
+            return false;
+        z = regs[prog_.result_register()];
+
+        // A box mapped into itself traps every orbit in it for good.
+        if (z.re.lo >= previous.re.lo && z.re.hi <= previous.re.hi &&
+            z.im.lo >= previous.im.lo && z.im.hi <= previous.im.hi) {
+            iters = 0;
+            return true;
+        }
+    }
+    // Inside for all max_iters iterations, so reported as not escaping.
+    iters = 0;
+    return true;
+}
+
+}
+
+}
@@ -0,0 +1,472 @@
+#pragma once
+
+/*
+ * A small x86-64 code generator for the escape time loop.
+ *
+ * JitKernel takes a bytecode Program (see bytecode.hpp) along with the escape
+ * tolerance and iteration limit and emits machine code for the whole loop
+ *
+ *     while (abs(z) < escape && iters < max_iters) {
+ *         z = f(z, c);
+ *         iters += 1;
+ *     }
+ *
+ * into an executable mapping. The iteration counter lives in a register for
+ * the whole loop and the escape test is done on |z|^2 without a square root.
+ * Program registers are kept in a frame on the caller's stack addressed off
+ * rbx; arithmetic is done inline with scalar SSE instructions and the
+ * transcendental functions are calls back into the C++ standard library.
+ *
+ * The generator is only available on x86-64 Unix-likes (FRACTALS_HAVE_JIT is
+ * defined there) and only for float and double complex numbers; see
+ * jit_supported.
+ */
+
+#include "bytecode.hpp"
+
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__)
+#define FRACTALS_HAVE_JIT
+#include <sys/mman.h>
+#endif
+
+namespace fractals {
+
+namespace fn_parser {
+
+// Whether a JitKernel can be generated for complex numbers of type cmplx.
+template <typename cmplx>
+struct jit_supported : std::integral_constant<bool,
+#ifdef FRACTALS_HAVE_JIT
+    std::is_same<typename cmplx::value_type, float>::value ||
+    std::is_same<typename cmplx::value_type, double>::value
+#else
+    false
+#endif
+    > {};
+
+#ifdef FRACTALS_HAVE_JIT
+
+/*
+ * Owns a mapping holding generated code. The code is copied in while the
+ * mapping is writable and the mapping is then made executable (and no longer
+ * writable).
+ */
+class ExecutableMemory
+{
+public:
+    explicit ExecutableMemory(const std::vector<unsigned char>& code) :
+        size_(code.size())
+    {
+        void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::runtime_error("Unable to map memory for JIT code");
+        std::memcpy(p, code.data(), size_);
+        if (mprotect(p, size_, PROT_READ | PROT_EXEC) != 0) {
+            munmap(p, size_);
+            throw std::runtime_error("Unable to make JIT code executable");
+        }
+        mem_ = p;
+    }
+
+    ExecutableMemory(const ExecutableMemory&) = delete;
+    ExecutableMemory& operator=(const ExecutableMemory&) = delete;
+
+    ~ExecutableMemory() { munmap(mem_, size_); }
+
+    const void* get() const { return mem_; }
+
+private:
+    void* mem_;
+    std::size_t size_;
+};
+
+/*
+ * Operations that aren't generated inline are calls to one of these, with
+ * pointers to the operand registers and the destination register.
+ */
+template <typename cmplx>
+struct jit_helpers
+{
+    using helper = void (*)(const cmplx*, const cmplx*, cmplx*);
+
+    static void pow(const cmplx* a, const cmplx* b, cmplx* out)
+    { *out = std::pow(*a, *b); }
+    static void abs(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = cmplx(std::abs(*a)); }
+    static void exp(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = std::exp(*a); }
+    static void sin(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = std::sin(*a); }
+    static void cos(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = std::cos(*a); }
+    static void tan(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = std::tan(*a); }
+    static void asin(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = std::asin(*a); }
+    static void acos(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = std::acos(*a); }
+    static void atan(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = std::atan(*a); }
+    static void sqrt(const cmplx* a, const cmplx*, cmplx* out)
+    { *out = std::sqrt(*a); }
+
+    static helper get(op code)
+    {
+        switch (code) {
+        case op::POW: return pow;
+        case op::ABS: return abs;
+        case op::EXP: return exp;
+        case op::SIN: return sin;
+        case op::COS: return cos;
+        case op::TAN: return tan;
+        case op::ASIN: return asin;
+        case op::ACOS: return acos;
+        case op::ATAN: return atan;
+        case op::SQRT: return sqrt;
+        default: return nullptr;
+        }
+    }
+};
+
+/*
+ * Instruction encoder. Only the handful of instructions the kernel needs are
+ * here; SSE registers are numbered 0-7 so none of them need a REX prefix and
+ * every memory operand is [rbx + disp32].
+ */
+template <typename real>
+class Assembler
+{
+public:
+    // Opcodes of the scalar SSE instructions (after the 0F escape byte).
+    enum sse : unsigned char {
+        LOAD = 0x10, STORE = 0x11, SQRT = 0x51, ADD = 0x58, MUL = 0x59,
+        SUB = 0x5C, DIV = 0x5E
+    };
+
+    std::vector<unsigned char>& code() { return code_; }
+    std::size_t position() const { return code_.size(); }
+
+    // op xmm, [rbx + disp] (or [rbx + disp], xmm for STORE).
+    void sse_mem(sse opc, unsigned xmm, std::int32_t disp)
+    {
+        byte(scalar_prefix); byte(0x0F); byte(opc);
+        byte(0x80 | (xmm << 3) | 3);
+        dword(disp);
+    }
+
+    // op xmm_dst, xmm_src.
+    void sse_reg(sse opc, unsigned dst, unsigned src)
+    {
+        byte(scalar_prefix); byte(0x0F); byte(opc);
+        byte(0xC0 | (dst << 3) | src);
+    }
+
+    void zero(unsigned xmm)
+    {
+        // xorps xmm, xmm
+        byte(0x0F); byte(0x57); byte(0xC0 | (xmm << 3) | xmm);
+    }
+
+    void ucomi(unsigned a, unsigned b)
+    {
+        if (std::is_same<real, double>::value)
+            byte(0x66);
+        byte(0x0F); byte(0x2E); byte(0xC0 | (a << 3) | b);
+    }
+
+    // lea {rdi, rsi, rdx}, [rbx + disp] for arguments 0, 1, 2.
+    void lea_arg(unsigned arg, std::int32_t disp)
+    {
+        static const unsigned char regs[] = { 7, 6, 2 };
+        byte(0x48); byte(0x8D); byte(0x80 | (regs[arg] << 3) | 3);
+        dword(disp);
+    }
+
+    void call(const void* target)
+    {
+        // mov rax, imm64; call rax
+        byte(0x48); byte(0xB8);
+        std::uint64_t addr = reinterpret_cast<std::uintptr_t>(target);
+        for (unsigned i = 0; i < 8; ++i)
+            byte((addr >> (8*i)) & 0xFF);
+        byte(0xFF); byte(0xD0);
+    }
+
+    void prologue()
+    {
+        // push rbx; push rbp; push r12; mov rbx, rdi; xor r12d, r12d
+        byte(0x53); byte(0x55); byte(0x41); byte(0x54);
+        byte(0x48); byte(0x89); byte(0xFB);
+        byte(0x45); byte(0x31); byte(0xE4);
+    }
+
+    void epilogue()
+    {
+        // mov eax, r12d; pop r12; pop rbp; pop rbx; ret
+        byte(0x44); byte(0x89); byte(0xE0);
+        byte(0x41); byte(0x5C); byte(0x5D); byte(0x5B); byte(0xC3);
+    }
+
+    void cmp_counter(std::uint32_t imm)
+    {
+        // cmp r12d, imm32
+        byte(0x41); byte(0x81); byte(0xFC); dword(imm);
+    }
+
+    void inc_counter()
+    {
+        byte(0x41); byte(0xFF); byte(0xC4);
+    }
+
+    void zero_counter()
+    {
+        byte(0x45); byte(0x31); byte(0xE4);
+    }
+
+    // Conditional jumps with a 32 bit displacement; returns the position of
+    // the displacement so it can be patched once the target is known.
+    enum cond : unsigned char { JAE = 0x83, JNE = 0x85, JBE = 0x86 };
+
+    std::size_t jcc(cond cc)
+    {
+        byte(0x0F); byte(cc); dword(0);
+        return position() - 4;
+    }
+
+    void jmp(std::size_t target)
+    {
+        byte(0xE9);
+        dword(std::int32_t(target) - std::int32_t(position() + 4));
+    }
+
+    void patch(std::size_t at, std::size_t target)
+    {
+        std::int32_t rel = std::int32_t(target) - std::int32_t(at + 4);
+        std::memcpy(&code_[at], &rel, 4);
+    }
+
+private:
+    static constexpr unsigned char scalar_prefix =
+        std::is_same<real, double>::value ? 0xF2 : 0xF3;
+
+    std::vector<unsigned char> code_;
+
+    void byte(unsigned char b) { code_.push_back(b); }
+
+    void dword(std::int32_t d)
+    {
+        unsigned char bytes[4];
+        std::memcpy(bytes, &d, 4);
+        code_.insert(code_.end(), bytes, bytes + 4);
+    }
+};
+
+template <typename real>
+constexpr unsigned char Assembler<real>::scalar_prefix;
+
+/*
+ * A compiled escape time loop. Calling it with a test point returns the same
+ * count as ctestfun/ztestfun in options.hpp: the number of iterations needed
+ * to escape, or 0 if the point didn't escape in max_iters iterations.
+ */
+template <typename cmplx>
+class JitKernel
+{
+public:
+    using real = typename cmplx::value_type;
+
+    // 'point_is_c' selects between the two modes of operation: the test
+    // point is c and 'constant' is the initial z, or the other way around.
+    JitKernel(const Program<cmplx>& prog, const cmplx& constant, real escape,
+              unsigned max_iters, bool point_is_c);
+
+    unsigned operator()(const cmplx& point) const
+    {
+        RegisterFile<cmplx> frame(frame_);
+        frame[point_register_] = point;
+        return entry_(frame.data());
+    }
+
+private:
+    using entry_fn = unsigned (*)(cmplx*);
+
+    std::vector<cmplx> frame_;
+    unsigned point_register_;
+    std::shared_ptr<ExecutableMemory> mem_;
+    entry_fn entry_;
+};
+
+template <typename cmplx>
+JitKernel<cmplx>::JitKernel(const Program<cmplx>& prog, const cmplx& constant,
+                            real escape, unsigned max_iters, bool point_is_c)
+{
+    using P = Program<cmplx>;
+    using A = Assembler<real>;
+    static_assert(sizeof(cmplx) == 2 * sizeof(real),
+                  "complex numbers must be laid out as two reals");
+
+    // The frame is the program's register file followed by escape^2. If c
+    // is the constant the setup part of the program is run once, here;
+    // otherwise it's compiled in ahead of the loop.
+    if (point_is_c) {
+        frame_ = prog.initial_registers();
+        frame_[P::z_register] = constant;
+        point_register_ = P::c_register;
+    } else {
+        frame_ = prog.initial_registers(constant);
+        point_register_ = P::z_register;
+    }
+    const unsigned esc_register = frame_.size();
+    frame_.push_back(cmplx(escape * escape));
+
+    auto re = [](unsigned r) { return std::int32_t(2 * r * sizeof(real)); };
+    auto im = [](unsigned r) { return std::int32_t((2 * r + 1) * sizeof(real)); };
+
+    A a;
+    a.prologue();
+
+    auto emit = [&](const Instruction& ins)
+    {
+        switch (ins.code) {
+        case op::NEG:
+            a.zero(0);
+            a.sse_mem(A::SUB, 0, re(ins.a));
+            a.zero(1);
+            a.sse_mem(A::SUB, 1, im(ins.a));
+            break;
+        case op::ADD:
+        case op::SUB:
+        {
+            auto opc = ins.code == op::ADD ? A::ADD : A::SUB;
+            a.sse_mem(A::LOAD, 0, re(ins.a));
+            a.sse_mem(opc, 0, re(ins.b));
+            a.sse_mem(A::LOAD, 1, im(ins.a));
+            a.sse_mem(opc, 1, im(ins.b));
+            break;
+        }
+        case op::MUL:
+            a.sse_mem(A::LOAD, 0, re(ins.a));
+            a.sse_mem(A::MUL, 0, re(ins.b));
+            a.sse_mem(A::LOAD, 2, im(ins.a));
+            a.sse_mem(A::MUL, 2, im(ins.b));
+            a.sse_reg(A::SUB, 0, 2);
+            a.sse_mem(A::LOAD, 1, re(ins.a));
+            a.sse_mem(A::MUL, 1, im(ins.b));
+            a.sse_mem(A::LOAD, 3, im(ins.a));
+            a.sse_mem(A::MUL, 3, re(ins.b));
+            a.sse_reg(A::ADD, 1, 3);
+            break;
+        case op::SQUARE:
+            a.sse_mem(A::LOAD, 0, re(ins.a));
+            a.sse_reg(A::MUL, 0, 0);
+            a.sse_mem(A::LOAD, 2, im(ins.a));
+            a.sse_reg(A::MUL, 2, 2);
+            a.sse_reg(A::SUB, 0, 2);
+            a.sse_mem(A::LOAD, 1, re(ins.a));
+            a.sse_mem(A::MUL, 1, im(ins.a));
+            a.sse_reg(A::ADD, 1, 1);
+            break;
+        case op::DIV:
+            // |b|^2 in xmm4
+            a.sse_mem(A::LOAD, 4, re(ins.b));
+            a.sse_reg(A::MUL, 4, 4);
+            a.sse_mem(A::LOAD, 5, im(ins.b));
+            a.sse_reg(A::MUL, 5, 5);
+            a.sse_reg(A::ADD, 4, 5);
+            a.sse_mem(A::LOAD, 0, re(ins.a));
+            a.sse_mem(A::MUL, 0, re(ins.b));
+            a.sse_mem(A::LOAD, 2, im(ins.a));
+            a.sse_mem(A::MUL, 2, im(ins.b));
+            a.sse_reg(A::ADD, 0, 2);
+            a.sse_reg(A::DIV, 0, 4);
+            a.sse_mem(A::LOAD, 1, im(ins.a));
+            a.sse_mem(A::MUL, 1, re(ins.b));
+            a.sse_mem(A::LOAD, 3, re(ins.a));
+            a.sse_mem(A::MUL, 3, im(ins.b));
+            a.sse_reg(A::SUB, 1, 3);
+            a.sse_reg(A::DIV, 1, 4);
+            break;
+        case op::REAL:
+            a.sse_mem(A::LOAD, 0, re(ins.a));
+            a.zero(1);
+            break;
+        case op::IMAG:
+            a.zero(0);
+            a.sse_mem(A::LOAD, 1, im(ins.a));
+            break;
+        case op::CONJ:
+            a.sse_mem(A::LOAD, 0, re(ins.a));
+            a.zero(1);
+            a.sse_mem(A::SUB, 1, im(ins.a));
+            break;
+        default:
+            a.lea_arg(0, re(ins.a));
+            a.lea_arg(1, re(ins.b));
+            a.lea_arg(2, re(ins.dst));
+            a.call(reinterpret_cast<const void*>(jit_helpers<cmplx>::get(ins.code)));
+            return;
+        }
+        a.sse_mem(A::STORE, 0, re(ins.dst));
+        a.sse_mem(A::STORE, 1, im(ins.dst));
+    };
+
+    const auto& code = prog.instructions();
+    if (point_is_c) {
+        for (unsigned i = 0; i < prog.setup_size(); ++i)
+            emit(code[i]);
+    }
+
+    // Loop head: escape test and iteration limit.
+    const std::size_t loop = a.position();
+    a.sse_mem(A::LOAD, 0, re(P::z_register));
+    a.sse_reg(A::MUL, 0, 0);
+    a.sse_mem(A::LOAD, 1, im(P::z_register));
+    a.sse_reg(A::MUL, 1, 1);
+    a.sse_reg(A::ADD, 0, 1);
+    a.sse_mem(A::LOAD, 1, re(esc_register));
+    // Exits when escape^2 <= |z|^2 or either one is NaN.
+    a.ucomi(1, 0);
+    const std::size_t exit_escaped = a.jcc(A::JBE);
+    a.cmp_counter(max_iters);
+    const std::size_t exit_limit = a.jcc(A::JAE);
+
+    for (unsigned i = prog.setup_size(); i < code.size(); ++i)
+        emit(code[i]);
+
+    if (prog.result_register() != P::z_register) {
+        a.sse_mem(A::LOAD, 0, re(prog.result_register()));
+        a.sse_mem(A::LOAD, 1, im(prog.result_register()));
+        a.sse_mem(A::STORE, 0, re(P::z_register));
+        a.sse_mem(A::STORE, 1, im(P::z_register));
+    }
+    a.inc_counter();
+    a.jmp(loop);
+
+    // Points that never escaped report 0.
+    const std::size_t done = a.position();
+    a.patch(exit_escaped, done);
+    a.patch(exit_limit, done);
+    a.cmp_counter(max_iters);
+    const std::size_t keep = a.jcc(A::JNE);
+    a.zero_counter();
+    a.patch(keep, a.position());
+    a.epilogue();
+
+    mem_ = std::make_shared<ExecutableMemory>(a.code());
+    entry_ = reinterpret_cast<entry_fn>(const_cast<void*>(mem_->get()));
+}
+
+#endif /* FRACTALS_HAVE_JIT */
+
+}
+
+}
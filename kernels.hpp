@@ -0,0 +1,458 @@
+#pragma once
+
+/*
+ * Hand-written kernels for the classic escape time formulas.
+ *
+ * recognize() checks whether a parsed function is one of
+ *
+ *     z^n + c          (the Mandelbrot set and multibrots, n >= 2)
+ *     conj(z)^n + c    (the tricorn and its higher powers)
+ *     c*z*(1 - z)      (the logistic map)
+ *
+ * in any of the usual ways of writing it, by matching the structure of the
+ * simplified Expression (see simplify.hpp, which already turns z*z into
+ * z^2, puts the operands of + and * in order and so on). Only the exact
+ * formula matches: a function that merely evaluates close to one of these
+ * isn't one. A recognized formula is then run by a
+ * FormulaKernel, which is templated on the complex type, the step function
+ * and the mode of operation so the compiler can inline the whole iteration
+ * and vectorize it across a row of points. Anything else goes through the
+ * general path in function_parser.hpp.
+ */
+
+#include "bytecode.hpp"
+#include "cycles.hpp"
+#include "expression.hpp"
+#include "packet.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+namespace fractals {
+
+namespace fn_parser {
+
+enum class formula
+{
+    none, multibrot, tricorn, logistic
+};
+
+struct KnownFormula
+{
+    formula kind;
+    unsigned power;
+};
+
+// Largest n for which z^n + c and conj(z)^n + c are recognized.
+constexpr unsigned max_recognized_power = 32;
+
+namespace {
+
+    // n if node i of 'expr' is b^n for b = z (or conj(z) with 'conj'),
+    // built from squares, products and positive integer powers, else 0.
+    // Anything above max_recognized_power counts as no match.
+    unsigned power_of(const Expression& expr, unsigned i, bool conj)
+    {
+        const Node& n = expr[i];
+        unsigned p = 0;
+        switch (n.code) {
+        case op::Z:
+            return conj ? 0 : 1;
+        case op::CONJ:
+            return conj && expr[n.lhs].code == op::Z ? 1 : 0;
+        case op::SQUARE:
+            p = 2 * power_of(expr, n.lhs, conj);
+            break;
+        case op::MUL:
+        {
+            const unsigned a = power_of(expr, n.lhs, conj);
+            const unsigned b = power_of(expr, n.rhs, conj);
+            p = a > 0 && b > 0 ? a + b : 0;
+            break;
+        }
+        case op::POW:
+        {
+            const Node& e = expr[n.rhs];
+            const double k = e.value.real();
+            if (e.code != op::CONSTANT || e.value.imag() != 0 || !(k >= 1) ||
+                !(k <= max_recognized_power) || k != double(unsigned(k)))
+                return 0;
+            p = unsigned(k) * power_of(expr, n.lhs, conj);
+            break;
+        }
+        default:
+            return 0;
+        }
+        return p <= max_recognized_power ? p : 0;
+    }
+
+    // The factors of a product, however it's grouped.
+    void factors(const Expression& expr, unsigned i,
+                 std::vector<unsigned>& out)
+    {
+        if (expr[i].code == op::MUL) {
+            factors(expr, expr[i].lhs, out);
+            factors(expr, expr[i].rhs, out);
+        } else {
+            out.push_back(i);
+        }
+    }
+
+    bool is_one(const Expression& expr, unsigned i)
+    {
+        return expr[i].code == op::CONSTANT &&
+               expr[i].value == std::complex<double>(1);
+    }
+
+    // Whether the product of 'fs' is c*z*(1 - z), as c, z, 1 - z or as
+    // c, z - z^2.
+    bool is_logistic(const Expression& expr, std::vector<unsigned> fs)
+    {
+        auto take = [&](auto pred)
+        {
+            auto it = std::find_if(fs.begin(), fs.end(), pred);
+            if (it == fs.end())
+                return false;
+            fs.erase(it);
+            return true;
+        };
+        auto code_is = [&](op code)
+        {
+            return [&expr, code](unsigned i) { return expr[i].code == code; };
+        };
+        if (!take(code_is(op::C)))
+            return false;
+        if (take([&](unsigned i)
+                 {
+                     const Node& n = expr[i];
+                     return n.code == op::SUB && expr[n.lhs].code == op::Z &&
+                            power_of(expr, n.rhs, false) == 2;
+                 }))
+            return fs.empty();
+        return take(code_is(op::Z)) &&
+               take([&](unsigned i)
+                    {
+                        const Node& n = expr[i];
+                        return n.code == op::SUB && is_one(expr, n.lhs) &&
+                               expr[n.rhs].code == op::Z;
+                    }) &&
+               fs.empty();
+    }
+
+}
+
+inline KnownFormula recognize(const Expression& expr)
+{
+    const Node& root = expr[expr.root()];
+
+    if (root.code == op::ADD) {
+        unsigned other;
+        if (expr[root.lhs].code == op::C)
+            other = root.rhs;
+        else if (expr[root.rhs].code == op::C)
+            other = root.lhs;
+        else
+            return KnownFormula{formula::none, 0};
+
+        unsigned n = power_of(expr, other, false);
+        if (n >= 2)
+            return KnownFormula{formula::multibrot, n};
+        n = power_of(expr, other, true);
+        // conj(z^n) is conj(z)^n.
+        if (n == 0 && expr[other].code == op::CONJ)
+            n = power_of(expr, expr[other].lhs, false);
+        if (n >= 2)
+            return KnownFormula{formula::tricorn, n};
+        return KnownFormula{formula::none, 0};
+    }
+
+    std::vector<unsigned> fs;
+    if (root.code == op::MUL) {
+        factors(expr, expr.root(), fs);
+        if (is_logistic(expr, fs))
+            return KnownFormula{formula::logistic, 0};
+    }
+    // c*z - c*z^2
+    if (root.code == op::SUB) {
+        std::vector<unsigned> a, b;
+        factors(expr, root.lhs, a);
+        factors(expr, root.rhs, b);
+        auto is = [&](const std::vector<unsigned>& f, unsigned power)
+        {
+            return f.size() == 2 &&
+                   ((expr[f[0]].code == op::C &&
+                     power_of(expr, f[1], false) == power) ||
+                    (expr[f[1]].code == op::C &&
+                     power_of(expr, f[0], false) == power));
+        };
+        if (is(a, 1) && is(b, 2))
+            return KnownFormula{formula::logistic, 0};
+    }
+    return KnownFormula{formula::none, 0};
+}
+
+/*
+ * Step functions: (x, y) <- f(x + iy, cx + i*cy), written out in real
+ * arithmetic.
+ */
+template <typename real>
+struct quadratic_step
+{
+    void operator()(real& x, real& y, real cx, real cy) const
+    {
+        real t = x*x - y*y + cx;
+        y = 2*x*y + cy;
+        x = t;
+    }
+};
+
+template <typename real>
+struct cubic_step
+{
+    void operator()(real& x, real& y, real cx, real cy) const
+    {
+        real x2 = x*x, y2 = y*y;
+        real t = x*(x2 - 3*y2) + cx;
+        y = y*(3*x2 - y2) + cy;
+        x = t;
+    }
+};
+
+// (x + iy)^n by repeated squaring.
+template <typename real>
+inline void integer_power(real& x, real& y, unsigned n)
+{
+    real rx = 1, ry = 0;
+    real bx = x, by = y;
+    while (true) {
+        if (n & 1) {
+            real t = rx*bx - ry*by;
+            ry = rx*by + ry*bx;
+            rx = t;
+        }
+        n >>= 1;
+        if (n == 0)
+            break;
+        real t = bx*bx - by*by;
+        by = 2*bx*by;
+        bx = t;
+    }
+    x = rx;
+    y = ry;
+}
+
+template <typename real>
+struct power_step
+{
+    unsigned n;
+
+    void operator()(real& x, real& y, real cx, real cy) const
+    {
+        integer_power(x, y, n);
+        x += cx;
+        y += cy;
+    }
+};
+
+template <typename real>
+struct tricorn_step
+{
+    void operator()(real& x, real& y, real cx, real cy) const
+    {
+        real t = x*x - y*y + cx;
+        y = -2*x*y + cy;
+        x = t;
+    }
+};
+
+template <typename real>
+struct tricorn_power_step
+{
+    unsigned n;
+
+    void operator()(real& x, real& y, real cx, real cy) const
+    {
+        y = -y;
+        integer_power(x, y, n);
+        x += cx;
+        y += cy;
+    }
+};
+
+template <typename real>
+struct logistic_step
+{
+    void operator()(real& x, real& y, real cx, real cy) const
+    {
+        // w = z - z^2, then c*w
+        real wx = x - (x*x - y*y);
+        real wy = y - 2*x*y;
+        x = cx*wx - cy*wy;
+        y = cx*wy + cy*wx;
+    }
+};
+
+/*
+ * Whether 'expr' is exactly z^2 + c. The simplifier turns every way of
+ * writing z^2 into one SQUARE node and puts the operands of + in order, so
+ * this is a sum of c and the square of z and nothing else.
+ */
+inline bool is_mandelbrot(const Expression& expr)
+{
+    const Node& root = expr[expr.root()];
+    if (root.code != op::ADD)
+        return false;
+    auto square_of_z = [&](unsigned i)
+    {
+        return expr[i].code == op::SQUARE && expr[expr[i].lhs].code == op::Z;
+    };
+    return (expr[root.lhs].code == op::C && square_of_z(root.rhs)) ||
+           (expr[root.rhs].code == op::C && square_of_z(root.lhs));
+}
+
+/*
+ * Whether c = x + iy lies strictly inside the main cardioid or the period-2
+ * bulb of the Mandelbrot set. Orbits of z^2 + c from z = 0 are then attracted
+ * to a fixed point or a 2-cycle and never leave the disk of radius 2, so the
+ * escape time loop would run to max_iterations. Together the two regions are
+ * most of the area of the set.
+ */
+template <typename real>
+inline bool in_main_bulbs(real x, real y)
+{
+    const real y2 = y*y;
+    const real u = x - real(0.25);
+    const real q = u*u + y2;
+    if (q*(q + u) < real(0.25)*y2)
+        return true;
+    const real v = x + 1;
+    return v*v + y2 < real(0.0625);
+}
+
+/*
+ * Escape time loop for one of the steps above. If 'PointIsC' the test point
+ * is c and 'constant' is the initial value of z; otherwise the test point is
+ * the initial z and 'constant' is c. Results are the same as those of
+ * ctestfun/ztestfun in options.hpp. If 'detect_cycles' is set, orbits found
+ * to be periodic (see cycles.hpp) are stopped early.
+ */
+template <typename cmplx, typename Step, bool PointIsC>
+class FormulaKernel
+{
+public:
+    using real = typename cmplx::value_type;
+
+    static constexpr unsigned width =
+        sizeof(real) < simd_bytes ? simd_bytes / sizeof(real) : 1;
+
+    FormulaKernel(const Step& step, const cmplx& constant, real escape,
+                  unsigned max_iters, bool detect_cycles = false) :
+        step_(step), constant_(constant), escape2_(escape * escape),
+        max_iters_(max_iters), detect_cycles_(detect_cycles) {}
+
+    unsigned operator()(const cmplx& point) const
+    {
+        const cmplx z0 = PointIsC ? constant_ : point;
+        const cmplx c = PointIsC ? point : constant_;
+        real x = z0.real(), y = z0.imag();
+        real sx = x, sy = y;
+        unsigned iters = 0;
+        while (x*x + y*y < escape2_ && iters < max_iters_) {
+            step_(x, y, c.real(), c.imag());
+            iters += 1;
+            if (detect_cycles_) {
+                if (std::abs(x - sx) + std::abs(y - sy) < tolerance)
+                    return 0;
+                if (cycle_checkpoint(iters)) {
+                    sx = x;
+                    sy = y;
+                }
+            }
+        }
+        return iters == max_iters_ ? 0 : iters;
+    }
+
+    /*
+     * Test the 'n' points start, start + dx, start + 2*dx, ... and write the
+     * results to 'out'. Points are iterated 'width' at a time with per-lane
+     * escape masks, the same way as PacketKernel does it.
+     */
+    void operator()(const cmplx& start, real dx, unsigned n,
+                    unsigned* out) const
+    {
+        for (unsigned first = 0; first < n; first += width) {
+            real x[width], y[width], cx[width], cy[width];
+            real sx[width], sy[width];
+            unsigned counts[width], periodic[width];
+            for (unsigned l = 0; l < width; ++l) {
+                unsigned j = std::min(first + l, n - 1);
+                real px = start.real() + j*dx, py = start.imag();
+                x[l] = PointIsC ? constant_.real() : px;
+                y[l] = PointIsC ? constant_.imag() : py;
+                cx[l] = PointIsC ? px : constant_.real();
+                cy[l] = PointIsC ? py : constant_.imag();
+                sx[l] = x[l];
+                sy[l] = y[l];
+                counts[l] = 0;
+                periodic[l] = 0;
+            }
+
+            for (unsigned iter = 0; iter < max_iters_; ++iter) {
+                unsigned active[width];
+                unsigned any = 0;
+                for (unsigned l = 0; l < width; ++l) {
+                    active[l] = !periodic[l] &&
+                                x[l]*x[l] + y[l]*y[l] < escape2_;
+                    any |= active[l];
+                }
+                if (!any)
+                    break;
+                for (unsigned l = 0; l < width; ++l) {
+                    real nx = x[l], ny = y[l];
+                    step_(nx, ny, cx[l], cy[l]);
+                    x[l] = active[l] ? nx : x[l];
+                    y[l] = active[l] ? ny : y[l];
+                    counts[l] += active[l];
+                }
+                // All lanes have the same checkpoints, as they started
+                // together.
+                if (detect_cycles_) {
+                    for (unsigned l = 0; l < width; ++l)
+                        periodic[l] |= active[l] &&
+                            std::abs(x[l] - sx[l]) + std::abs(y[l] - sy[l]) <
+                            tolerance;
+                    if (cycle_checkpoint(iter + 1)) {
+                        std::copy_n(x, width, sx);
+                        std::copy_n(y, width, sy);
+                    }
+                }
+            }
+
+            for (unsigned l = 0; l < width && first + l < n; ++l)
+                out[first + l] = periodic[l] || counts[l] == max_iters_ ?
+                                 0 : counts[l];
+        }
+    }
+
+private:
+    static constexpr real tolerance = cycle_tolerance<real>();
+
+    Step step_;
+    cmplx constant_;
+    real escape2_;
+    unsigned max_iters_;
+    bool detect_cycles_;
+};
+
+template <typename cmplx, typename Step, bool PointIsC>
+constexpr unsigned FormulaKernel<cmplx, Step, PointIsC>::width;
+
+template <typename cmplx, typename Step, bool PointIsC>
+constexpr typename cmplx::value_type
+FormulaKernel<cmplx, Step, PointIsC>::tolerance;
+
+}
+
+}
@@ -9,14 +9,161 @@
 
 #include "options.hpp"
 #include "color_scale.hpp"
+#include "distance.hpp"
 #include "fractals.hpp"
+#include "perturbation.hpp"
+#include "progressive.hpp"
+#include "subdivide.hpp"
+#include "supersample.hpp"
+#include "thread_pool.hpp"
 
+#include <algorithm>
 #include <complex>
+#include <cstdio>
 #include <cstdlib>
 #include <fstream>
+#include <string>
 
 using cmplx = std::complex<float>;
 
+// The color of a point with the given iteration count.
+fractals::Color color(const ColorScale& colorscale, unsigned iters)
+{
+    return iters == 0 ? fractals::Color{0, 0, 0} : colorscale.color(iters);
+}
+
+// Points that already have a color (see supersample.hpp) keep it.
+fractals::Color color(const ColorScale&, const fractals::Color& clr)
+{
+    return clr;
+}
+
+// Save the image to 'output', a file name or "-" for stdout. The file is
+// closed afterwards, stdout included.
+template <typename C, typename T>
+void save(const std::string& output, const fractals::Fractal<C, T>& result,
+          const ColorScale& colorscale)
+{
+    save_fractal_img(result, output == "-" ? stdout : 
+                     fopen(output.c_str(), "wb"), 
+    [&] (const T& value, fractals::Color& clr)
+    {
+        clr = color(colorscale, value);
+    });
+}
+
+/*
+ * Test every point of the domain with 'kernel', using the threads of 'pool',
+ * and save the image. This is instantiated for each concrete kernel type
+ * (see visit_kernel in options.hpp), so testing a row of points is a
+ * direct, inlinable call.
+ */
+template <typename Kernel>
+void render(const fractals::options::FractalOptions<cmplx>& opts,
+            const Kernel& kernel, const ColorScale& colorscale,
+            fractals::ThreadPool& pool)
+{
+    auto point_checker = [&](const fractals::Domain<cmplx>& dom, 
+        vector_slice<unsigned>& slice) -> void
+    {
+        auto dx = (dom.upper_right.real() - dom.lower_left.real()) /
+            (dom.nacross - 1);
+        auto dy = (dom.upper_right.imag() - dom.lower_left.imag()) /
+            (dom.nup - 1);
+        
+        // Fill in the points (i, j) with i0 <= i < i1, j0 <= j < j1.
+        auto fill = [&](unsigned i0, unsigned i1, unsigned j0, unsigned j1)
+        {
+            if (opts.strategy == fractals::options::render_strategy::subdivide) {
+                fractals::subdivide(dom, slice, kernel, i0, i1, j0, j1);
+                return;
+            }
+            if (opts.strategy == fractals::options::render_strategy::distance) {
+                fractals::distance_fill(dom, slice, kernel, opts.kernel.dual,
+                                        opts.kernel.escape,
+                                        opts.kernel.max_iters, i0, i1, j0, j1);
+                return;
+            }
+            for (unsigned i = i0; i < i1; ++i) {
+                cmplx start(dom.lower_left.real() + j0*dx,
+                            dom.lower_left.imag() + i*dy);
+                kernel(start, dx, j1 - j0, &slice[i*slice.stride() + j0]);
+            }
+        };
+
+        if (!opts.test_box) {
+            fill(0, dom.nup, 0, dom.nacross);
+            return;
+        }
+
+        // Try to settle each tile as a whole and only test the points of
+        // the ones where that fails.
+        const unsigned size = opts.box_size;
+        for (unsigned i0 = 0; i0 < dom.nup; i0 += size) {
+            const unsigned i1 = std::min(i0 + size, dom.nup);
+            for (unsigned j0 = 0; j0 < dom.nacross; j0 += size) {
+                const unsigned j1 = std::min(j0 + size, dom.nacross);
+                cmplx ll(dom.lower_left.real() + j0*dx,
+                         dom.lower_left.imag() + i0*dy);
+                cmplx ur(dom.lower_left.real() + (j1 - 1)*dx,
+                         dom.lower_left.imag() + (i1 - 1)*dy);
+                unsigned iters;
+                if (opts.test_box(ll, ur, iters)) {
+                    for (unsigned i = i0; i < i1; ++i)
+                        for (unsigned j = j0; j < j1; ++j)
+                            slice[i*slice.stride() + j] = iters;
+                    continue;
+                }
+                fill(i0, i1, j0, j1);
+            }
+        }
+    };
+
+    if (opts.strategy == fractals::options::render_strategy::progressive) {
+        // Each preview replaces the last one as a whole. stdout is closed
+        // after one image, so only the finished one can go there.
+        auto show = [&](const fractals::Fractal<cmplx>& preview)
+        {
+            if (opts.output == "-")
+                return;
+            const std::string part = opts.output + ".part";
+            save(part, preview, colorscale);
+            std::rename(part.c_str(), opts.output.c_str());
+        };
+        auto result = fractals::progressive(opts.domain, kernel, pool, show);
+        save(opts.output, result, colorscale);
+        return;
+    }
+
+    if (opts.supersample.samples <= 1) {
+        auto result = fractals::make_fractal(opts.domain, point_checker,
+                                             pool, opts.scheduling);
+        save(opts.output, result, colorscale);
+        return;
+    }
+
+    // Colors are computed directly, so pixels can be averages of several.
+    const auto& dom = opts.domain;
+    const auto dx = (dom.upper_right.real() - dom.lower_left.real()) /
+        (dom.nacross - 1);
+    const auto dy = (dom.upper_right.imag() - dom.lower_left.imag()) /
+        (dom.nup - 1);
+    auto color_checker = [&](const fractals::Domain<cmplx>& band,
+        vector_slice<fractals::Color>& slice) -> void
+    {
+        fractals::supersample(band, dx, dy, slice, point_checker, kernel,
+                              [&](unsigned iters)
+                              {
+                                  return color(colorscale, iters);
+                              },
+                              opts.supersample.samples,
+                              opts.supersample.threshold);
+    };
+    auto result = fractals::make_fractal<fractals::Color>(
+        dom, color_checker, pool, opts.scheduling);
+    save(opts.output, result, colorscale);
+}
+
 int main(int argc, char* argv[])
 {
     if (argc != 2)
@@ -36,31 +183,22 @@ int main(int argc, char* argv[])
     }
 
     ColorScale colorscale(opts.colors);
+    fractals::ThreadPool pool(opts.numthreads, opts.pin_threads);
 
-    auto point_checker = [=](const fractals::Domain<cmplx>& dom, 
-        vector_slice<unsigned>& slice) -> void
-    {
-        auto dx = (dom.upper_right.real() - dom.lower_left.real()) /
-            (dom.nacross - 1);
-        auto dy = (dom.upper_right.imag() - dom.lower_left.imag()) /
-            (dom.nup - 1);
-        
-        for (unsigned i = 0; i < dom.nup; ++i) {
-            for (unsigned j = 0; j < dom.nacross; ++j) {
-                cmplx c(dom.lower_left.real() + j*dx, 
-                        dom.lower_left.imag() + i*dy);
-                slice[i*dom.nacross + j] = opts.test_function(c);
-            }
-        }
-    };
-
-    auto result = fractals::make_fractal(opts.domain, point_checker, opts.numthreads);
+    if (opts.deep_zoom.enabled) {
+        const auto& zoom = opts.deep_zoom;
+        const auto& spec = opts.kernel;
+        auto result = fractals::deep_zoom(
+            zoom.center_re, zoom.center_im, zoom.radius, opts.domain.nacross,
+            opts.domain.nup, std::complex<double>(spec.constant), spec.escape,
+            spec.max_iters, pool);
+        save(opts.output, result, colorscale);
+        return 0;
+    }
 
-    save_fractal_img(result, opts.output == "-" ? stdout : 
-                     fopen(opts.output.c_str(), "wb"), 
-    [&] (unsigned iters, fractals::Color& clr)
+    fractals::options::visit_kernel(opts.kernel, [&](const auto& kernel)
     {
-        clr = iters == 0 ? fractals::Color{0, 0, 0} : colorscale.color(iters);
+        render(opts, kernel, colorscale, pool);
     });
     return 0;
 }
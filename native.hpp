@@ -0,0 +1,486 @@
+#pragma once
+
+/*
+ * Ahead-of-time compilation of the escape time loop with the system
+ * compiler.
+ *
+ * NativeKernel writes a parsed function out as C++ source for a row kernel
+ * (the same lane-parallel loop as FormulaKernel in kernels.hpp, with the
+ * function inlined), builds it into a shared object with
+ *
+ *     $CXX -O3 -march=native -ffast-math -shared -fPIC
+ *
+ * and loads it with dlopen(). Built objects are kept in a cache directory,
+ * named by a hash of the generated source (which covers the function, the
+ * real type and the mode), the compiler command and the target -march=native
+ * resolves to, so each formula is only ever compiled once per machine and a
+ * cache shared between machines never hands out code for another CPU. The
+ * escape tolerance, iteration limit and constant are arguments of the kernel
+ * and don't affect the cache.
+ *
+ * The cache directory is $FRACTALMAKE_CACHE if set, otherwise
+ * $XDG_CACHE_HOME/fractalmake or ~/.cache/fractalmake. Without a home
+ * directory it's fractalmake-<uid> in $TMPDIR or /tmp, which has to be a
+ * directory of the user's that no one else can write to. The compiler is
+ * $CXX, defaulting to c++. Only available on Unix-likes
+ * (FRACTALS_HAVE_NATIVE).
+ */
+
+#include "expression.hpp"
+
+#include <cerrno>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FRACTALS_HAVE_NATIVE
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fractals {
+
+namespace fn_parser {
+
+template <typename real> struct real_type_name;
+template <> struct real_type_name<float>
+{ static const char* get() { return "float"; } };
+template <> struct real_type_name<double>
+{ static const char* get() { return "double"; } };
+template <> struct real_type_name<long double>
+{ static const char* get() { return "long double"; } };
+
+// 64 bit FNV-1a; used for cache file names, so it has to be stable.
+inline std::uint64_t fnv1a(const std::string& s)
+{
+    std::uint64_t h = 14695981039346656037ull;
+    for (unsigned char ch : s) {
+        h ^= ch;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// std::isfinite() is always true under -ffast-math, so look at the bits.
+inline bool is_finite(double x)
+{
+    std::uint64_t b;
+    std::memcpy(&b, &x, sizeof b);
+    return (b & 0x7ff0000000000000ull) != 0x7ff0000000000000ull;
+}
+
+/*
+ * C++ source for a row kernel evaluating 'expr'. The kernel has C linkage
+ * and the signature of native_row_fn below. Throws std::runtime_error if a
+ * constant in 'expr' is infinite or NaN, which can't be written as a literal.
+ */
+inline std::string generate_source(const Expression& expr,
+                                   const std::string& real_name,
+                                   bool point_is_c)
+{
+    std::ostringstream src;
+    src << std::setprecision(std::numeric_limits<double>::max_digits10);
+    src << "// Generated by fractalmake\n"
+        << "#include <algorithm>\n#include <complex>\n\n"
+        << "typedef " << real_name << " real;\n"
+        << "typedef std::complex<real> cmplx;\n\n"
+        << "#if defined(__AVX512F__)\n"
+        << "static const unsigned width = 64 / sizeof(real);\n"
+        << "#elif defined(__AVX__)\n"
+        << "static const unsigned width = 32 / sizeof(real);\n"
+        << "#else\n"
+        << "static const unsigned width = 16 / sizeof(real);\n"
+        << "#endif\n\n";
+
+    std::vector<bool> live(expr.size(), false);
+    live[expr.root()] = true;
+    for (unsigned i = expr.size(); i-- > 0; ) {
+        if (!live[i])
+            continue;
+        if (arity(expr[i].code) > 0)
+            live[expr[i].lhs] = true;
+        if (arity(expr[i].code) > 1)
+            live[expr[i].rhs] = true;
+    }
+
+    // As in bytecode.hpp, whatever doesn't depend on z is computed by
+    // setup() before the loop; step() gets the values it needs from there.
+    std::vector<bool> varies(expr.size(), false);
+    std::vector<bool> exported(expr.size(), false);
+    for (unsigned i = 0; i < expr.size(); ++i) {
+        const Node& n = expr[i];
+        unsigned nargs = arity(n.code);
+        varies[i] = n.code == op::Z || (nargs > 0 && varies[n.lhs]) ||
+                    (nargs > 1 && varies[n.rhs]);
+        if (live[i] && varies[i]) {
+            if (nargs > 0 && !varies[n.lhs])
+                exported[n.lhs] = true;
+            if (nargs > 1 && !varies[n.rhs])
+                exported[n.rhs] = true;
+        }
+    }
+    if (!varies[expr.root()])
+        exported[expr.root()] = true;
+
+    auto name = [&](unsigned i)
+    {
+        switch (expr[i].code) {
+        case op::Z: return std::string("z");
+        case op::C: return std::string("c");
+        default: return "t" + std::to_string(i);
+        }
+    };
+    auto is_leaf = [&](unsigned i)
+    {
+        return expr[i].code == op::Z || expr[i].code == op::C;
+    };
+
+    auto emit = [&](unsigned i)
+    {
+        const Node& n = expr[i];
+        const std::string a = arity(n.code) > 0 ? name(n.lhs) : "";
+        const std::string b = arity(n.code) > 1 ? name(n.rhs) : "";
+        src << "    const cmplx " << name(i) << " = ";
+        switch (n.code) {
+        case op::CONSTANT:
+            if (!is_finite(n.value.real()) || !is_finite(n.value.imag()))
+                throw std::runtime_error("The 'native' backend needs finite "
+                                         "constants in the function");
+            src << "cmplx(real(" << n.value.real() << "), real("
+                << n.value.imag() << "))";
+            break;
+        case op::NEG: src << "-" << a; break;
+        case op::ADD: src << a << " + " << b; break;
+        case op::SUB: src << a << " - " << b; break;
+        case op::MUL: src << a << " * " << b; break;
+        case op::DIV: src << a << " / " << b; break;
+        case op::POW: src << "std::pow(" << a << ", " << b << ")"; break;
+        case op::SQUARE:
+            src << "cmplx(" << a << ".real()*" << a << ".real() - " << a
+                << ".imag()*" << a << ".imag(), 2*" << a << ".real()*" << a
+                << ".imag())";
+            break;
+        case op::ABS: src << "cmplx(std::abs(" << a << "))"; break;
+        case op::EXP: src << "std::exp(" << a << ")"; break;
+        case op::SIN: src << "std::sin(" << a << ")"; break;
+        case op::COS: src << "std::cos(" << a << ")"; break;
+        case op::TAN: src << "std::tan(" << a << ")"; break;
+        case op::ASIN: src << "std::asin(" << a << ")"; break;
+        case op::ACOS: src << "std::acos(" << a << ")"; break;
+        case op::ATAN: src << "std::atan(" << a << ")"; break;
+        case op::SQRT: src << "std::sqrt(" << a << ")"; break;
+        case op::REAL: src << "cmplx(" << a << ".real())"; break;
+        case op::IMAG: src << "cmplx(0, " << a << ".imag())"; break;
+        case op::CONJ: src << "std::conj(" << a << ")"; break;
+        default: break;
+        }
+        src << ";\n";
+    };
+
+    src << "struct invariants\n{\n";
+    for (unsigned i = 0; i < expr.size(); ++i)
+        if (exported[i] && !is_leaf(i))
+            src << "    cmplx " << name(i) << ";\n";
+    src << "};\n\n"
+        << "static inline invariants setup(const cmplx& c)\n{\n";
+    for (unsigned i = 0; i < expr.size(); ++i)
+        if (live[i] && !varies[i] && !is_leaf(i))
+            emit(i);
+    src << "    invariants inv;\n";
+    for (unsigned i = 0; i < expr.size(); ++i)
+        if (exported[i] && !is_leaf(i))
+            src << "    inv." << name(i) << " = " << name(i) << ";\n";
+    src << "    return inv;\n}\n\n"
+        << "static inline cmplx step(const cmplx& z, const cmplx& c, "
+           "const invariants& inv)\n{\n";
+    for (unsigned i = 0; i < expr.size(); ++i)
+        if (exported[i] && !is_leaf(i))
+            src << "    const cmplx& " << name(i) << " = inv." << name(i)
+                << ";\n";
+    for (unsigned i = 0; i < expr.size(); ++i)
+        if (live[i] && varies[i] && !is_leaf(i))
+            emit(i);
+    src << "    return " << name(expr.root()) << ";\n}\n\n";
+
+    const char* z0 = point_is_c ? "const_" : "p_";
+    const char* c = point_is_c ? "p_" : "const_";
+    src << "extern \"C\" void fractalmake_row(real start_re, real start_im, "
+           "real dx, unsigned n,\n"
+        << "    real const_re, real const_im, real escape2, "
+           "unsigned max_iters, unsigned* out)\n{\n"
+        << "    for (unsigned first = 0; first < n; first += width) {\n"
+        << "        real x[width], y[width], cx[width], cy[width];\n"
+        << "        unsigned counts[width];\n"
+        << "        for (unsigned l = 0; l < width; ++l) {\n"
+        << "            unsigned j = std::min(first + l, n - 1);\n"
+        << "            real p_re = start_re + j*dx, p_im = start_im;\n"
+        << "            x[l] = " << z0 << "re; y[l] = " << z0 << "im;\n"
+        << "            cx[l] = " << c << "re; cy[l] = " << c << "im;\n"
+        << "            counts[l] = 0;\n"
+        << "        }\n"
+        << "        invariants inv[width];\n"
+        << "        for (unsigned l = 0; l < width; ++l)\n"
+        << "            inv[l] = setup(cmplx(cx[l], cy[l]));\n"
+        << "        for (unsigned iter = 0; iter < max_iters; ++iter) {\n"
+        << "            unsigned active[width];\n"
+        << "            unsigned any = 0;\n"
+        << "            for (unsigned l = 0; l < width; ++l) {\n"
+        << "                active[l] = x[l]*x[l] + y[l]*y[l] < escape2;\n"
+        << "                any |= active[l];\n"
+        << "            }\n"
+        << "            if (!any)\n"
+        << "                break;\n"
+        << "            for (unsigned l = 0; l < width; ++l) {\n"
+        << "                cmplx w = step(cmplx(x[l], y[l]), "
+           "cmplx(cx[l], cy[l]), inv[l]);\n"
+        << "                x[l] = active[l] ? w.real() : x[l];\n"
+        << "                y[l] = active[l] ? w.imag() : y[l];\n"
+        << "                counts[l] += active[l];\n"
+        << "            }\n"
+        << "        }\n"
+        << "        for (unsigned l = 0; l < width && first + l < n; ++l)\n"
+        << "            out[first + l] = counts[l] == max_iters ? "
+           "0 : counts[l];\n"
+        << "    }\n"
+        << "}\n";
+    return src.str();
+}
+
+#ifdef FRACTALS_HAVE_NATIVE
+
+namespace {
+
+    std::string shell_quote(const std::string& s)
+    {
+        std::string quoted = "'";
+        for (char ch : s) {
+            if (ch == '\'')
+                quoted += "'\\''";
+            else
+                quoted += ch;
+        }
+        return quoted + "'";
+    }
+
+    // Output of a shell command, empty if it fails.
+    std::string command_output(const std::string& cmd)
+    {
+        std::string output;
+        if (FILE* pipe = popen(cmd.c_str(), "r")) {
+            char buf[4096];
+            std::size_t n;
+            while ((n = std::fread(buf, 1, sizeof(buf), pipe)) > 0)
+                output.append(buf, n);
+            if (pclose(pipe) != 0)
+                output.clear();
+        }
+        return output;
+    }
+
+    /*
+     * What -march=native means to 'cxx' on this machine: the target options
+     * it resolves to, or where the compiler can't list them (clang), the
+     * model and feature flags of the CPU.
+     */
+    std::string native_target(const std::string& cxx)
+    {
+        std::string target = command_output(
+            cxx + " -march=native -Q --help=target 2>/dev/null");
+        if (!target.empty())
+            return target;
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.compare(0, 10, "model name") == 0 ||
+                line.compare(0, 5, "flags") == 0 ||
+                line.compare(0, 8, "Features") == 0)
+                target += line + "\n";
+            else if (line.empty() && !target.empty())
+                break;
+        }
+        return target;
+    }
+
+    // mkdir -p; created directories are private to the user.
+    void make_directories(const std::string& path)
+    {
+        // Each prefix ending before a '/' (other than a leading one), then
+        // the whole path.
+        std::size_t pos = path.find('/', 1);
+        while (true) {
+            std::string prefix = path.substr(0, pos);
+            if (mkdir(prefix.c_str(), 0700) != 0 && errno != EEXIST)
+                throw std::runtime_error("Unable to create directory " +
+                                         prefix);
+            if (pos == std::string::npos)
+                break;
+            pos = path.find('/', pos + 1);
+        }
+    }
+
+    // A directory in a shared place, like /tmp, that only the user can
+    // write to; anyone else could have put their own kernels in it.
+    std::string private_directory(const std::string& path)
+    {
+        if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST)
+            throw std::runtime_error("Unable to create directory " + path);
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+            st.st_uid != getuid() || (st.st_mode & 0077) != 0)
+            throw std::runtime_error("Not using native kernel cache " + path +
+                                     ": it isn't a private directory; set "
+                                     "FRACTALMAKE_CACHE");
+        return path;
+    }
+
+    std::string native_cache_dir()
+    {
+        if (const char* dir = std::getenv("FRACTALMAKE_CACHE"))
+            return dir;
+        if (const char* xdg = std::getenv("XDG_CACHE_HOME"))
+            return std::string(xdg) + "/fractalmake";
+        if (const char* home = std::getenv("HOME"))
+            return std::string(home) + "/.cache/fractalmake";
+        const char* tmp = std::getenv("TMPDIR");
+        return private_directory(std::string(tmp ? tmp : "/tmp") +
+                                 "/fractalmake-" + std::to_string(getuid()));
+    }
+
+}
+
+/*
+ * Loads (building first if it isn't cached) the shared object for a
+ * function. Several processes may build the same kernel at once; each
+ * builds to a private file and renames it into place.
+ */
+class NativeLibrary
+{
+public:
+    using row_fn = void (*)();
+
+    explicit NativeLibrary(const std::string& source)
+    {
+        const char* cxx_env = std::getenv("CXX");
+        const std::string cxx = cxx_env ? cxx_env : "c++";
+        const std::string flags =
+            "-std=c++14 -O3 -march=native -ffast-math -shared -fPIC";
+
+        std::ostringstream key;
+        key << std::hex << std::setw(16) << std::setfill('0')
+            << fnv1a(cxx + "\n" + flags + "\n" + native_target(cxx) + "\n" +
+                     source);
+        const std::string dir = native_cache_dir();
+        const std::string base = dir + "/kernel-" + key.str();
+        const std::string lib = base + ".so";
+
+        if (access(lib.c_str(), R_OK) != 0) {
+            make_directories(dir);
+            const std::string tag = "." + std::to_string(getpid());
+            const std::string cpp = base + tag + ".cpp";
+            const std::string tmp = base + tag + ".so";
+            {
+                std::ofstream out(cpp);
+                out << source;
+                if (!out)
+                    throw std::runtime_error("Unable to write " + cpp);
+            }
+            const std::string cmd = cxx + " " + flags + " -o " +
+                shell_quote(tmp) + " " + shell_quote(cpp) + " 1>&2";
+            int status = std::system(cmd.c_str());
+            std::remove(cpp.c_str());
+            if (status != 0) {
+                std::remove(tmp.c_str());
+                throw std::runtime_error("Compiling native kernel failed: " +
+                                         cmd);
+            }
+            if (std::rename(tmp.c_str(), lib.c_str()) != 0) {
+                std::remove(tmp.c_str());
+                throw std::runtime_error("Unable to move kernel into " + lib);
+            }
+        }
+
+        handle_ = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle_)
+            throw std::runtime_error(std::string("Unable to load native "
+                                                 "kernel: ") + dlerror());
+        void* sym = dlsym(handle_, "fractalmake_row");
+        if (!sym) {
+            dlclose(handle_);
+            throw std::runtime_error("Native kernel is missing its entry "
+                                     "point: " + lib);
+        }
+        row_ = reinterpret_cast<row_fn>(sym);
+    }
+
+    NativeLibrary(const NativeLibrary&) = delete;
+    NativeLibrary& operator=(const NativeLibrary&) = delete;
+
+    ~NativeLibrary() { dlclose(handle_); }
+
+    row_fn get() const { return row_; }
+
+private:
+    void* handle_;
+    row_fn row_;
+};
+
+/*
+ * The escape time loop for a function, built by the system compiler.
+ * Results are the same as those of ctestfun/ztestfun in options.hpp.
+ */
+template <typename cmplx>
+class NativeKernel
+{
+public:
+    using real = typename cmplx::value_type;
+
+    NativeKernel(const Expression& expr, const cmplx& constant, real escape,
+                 unsigned max_iters, bool point_is_c) :
+        lib_(std::make_shared<NativeLibrary>(generate_source(expr,
+            real_type_name<real>::get(), point_is_c))),
+        row_(reinterpret_cast<native_row_fn>(lib_->get())),
+        constant_(constant), escape2_(escape * escape), max_iters_(max_iters)
+    {}
+
+    void operator()(const cmplx& start, real dx, unsigned n,
+                    unsigned* out) const
+    {
+        row_(start.real(), start.imag(), dx, n, constant_.real(),
+             constant_.imag(), escape2_, max_iters_, out);
+    }
+
+    unsigned operator()(const cmplx& point) const
+    {
+        unsigned result;
+        (*this)(point, real(0), 1, &result);
+        return result;
+    }
+
+private:
+    using native_row_fn = void (*)(real, real, real, unsigned, real, real,
+                                   real, unsigned, unsigned*);
+
+    std::shared_ptr<NativeLibrary> lib_;
+    native_row_fn row_;
+    cmplx constant_;
+    real escape2_;
+    unsigned max_iters_;
+};
+
+#endif /* FRACTALS_HAVE_NATIVE */
+
+}
+
+}
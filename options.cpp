@@ -1,4 +1,5 @@
 #include "options.hpp"
+#include "bigfixed.hpp"
 
 #include <cassert>
 #include <cctype>
@@ -221,6 +222,159 @@ std::string parse_string(std::istream& istream)
     return curr_token.contents;
 }
 
+backend parse_backend(std::istream& istream)
+{
+    Token curr_token = get_next_token(istream);
+    if (curr_token.type != token_type::keyword)
+        throw ParsingException("Expected a backend name");
+    if (curr_token.contents == "auto")
+        return backend::automatic;
+    else if (curr_token.contents == "bytecode")
+        return backend::bytecode;
+    else if (curr_token.contents == "jit")
+        return backend::jit;
+    else if (curr_token.contents == "packet")
+        return backend::packet;
+    else if (curr_token.contents == "formula")
+        return backend::formula;
+    else if (curr_token.contents == "native")
+        return backend::native;
+    throw ParsingException("Unknown backend '" + curr_token.contents + "'");
+}
+
+render_strategy parse_render_strategy(std::istream& istream)
+{
+    Token curr_token = get_next_token(istream);
+    if (curr_token.type != token_type::keyword)
+        throw ParsingException("Expected a renderer name");
+    if (curr_token.contents == "rows")
+        return render_strategy::rows;
+    else if (curr_token.contents == "subdivide")
+        return render_strategy::subdivide;
+    else if (curr_token.contents == "progressive")
+        return render_strategy::progressive;
+    else if (curr_token.contents == "distance")
+        return render_strategy::distance;
+    throw ParsingException("Unknown renderer '" + curr_token.contents + "'");
+}
+
+unsigned parse_num_threads(std::istream& istream)
+{
+    Token curr_token = get_next_token(istream);
+    if (curr_token.type == token_type::keyword && curr_token.contents == "auto")
+        return available_cpus();
+    if (curr_token.type != token_type::integer)
+        throw ParsingException("Expected an integer or 'auto' for "
+                               "'num_threads'");
+    unsigned n;
+    std::istringstream(curr_token.contents) >> n;
+    return n;
+}
+
+schedule parse_schedule(std::istream& istream)
+{
+    Token curr_token = get_next_token(istream);
+    if (curr_token.type != token_type::keyword)
+        throw ParsingException("Expected a schedule name");
+    if (curr_token.contents == "stealing")
+        return schedule::stealing;
+    else if (curr_token.contents == "cost")
+        return schedule::cost;
+    throw ParsingException("Unknown schedule '" + curr_token.contents + "'");
+}
+
+DeepZoom parse_deep_zoom(std::istream& istream)
+{
+    auto expect = [&](const std::string& symbol)
+    {
+        Token tok = get_next_token(istream);
+        if (tok.type != token_type::symbol || tok.contents != symbol)
+            throw ParsingException("Malformed deep_zoom - expected '" +
+                                   symbol + "'");
+    };
+    auto number = [&]()
+    {
+        Token tok = get_next_token(istream);
+        if (tok.type != token_type::floating &&
+            tok.type != token_type::integer)
+            throw ParsingException("Malformed deep_zoom - expected a number");
+        try {
+            BigFixed::parse(tok.contents, 2);
+        } catch (const std::invalid_argument& err) {
+            throw ParsingException(err.what());
+        }
+        return tok.contents;
+    };
+    auto keyword = [&](const std::string& word)
+    {
+        Token tok = get_next_token(istream);
+        if (tok.type != token_type::keyword || tok.contents != word)
+            throw ParsingException("Malformed deep_zoom - expected '" + word +
+                                   "'");
+        expect(":");
+    };
+
+    DeepZoom zoom;
+    expect("{");
+    keyword("center");
+    expect("{");
+    zoom.center_re = number();
+    expect(",");
+    zoom.center_im = number();
+    expect("}");
+    expect(",");
+    keyword("radius");
+    std::istringstream(number()) >> zoom.radius;
+    if (!(zoom.radius > 0))
+        throw ParsingException("The deep_zoom radius must be positive");
+    expect("}");
+    zoom.enabled = true;
+    return zoom;
+}
+
+Supersampling parse_supersampling(std::istream& istream)
+{
+    auto expect = [&](const std::string& symbol)
+    {
+        Token tok = get_next_token(istream);
+        if (tok.type != token_type::symbol || tok.contents != symbol)
+            throw ParsingException("Malformed supersample - expected '" +
+                                   symbol + "'");
+    };
+    auto keyword = [&](const std::string& word)
+    {
+        Token tok = get_next_token(istream);
+        if (tok.type != token_type::keyword || tok.contents != word)
+            throw ParsingException("Malformed supersample - expected '" +
+                                   word + "'");
+        expect(":");
+    };
+
+    Supersampling ss;
+    expect("{");
+    keyword("samples");
+    ss.samples = parse_integer(istream);
+    expect(",");
+    keyword("threshold");
+    ss.threshold = parse_integer(istream);
+    expect("}");
+    if (ss.samples == 0 || ss.samples > 16)
+        throw ParsingException("The number of samples must be from 1 to 16");
+    return ss;
+}
+
+bool parse_bool(std::istream& istream)
+{
+    Token curr_token = get_next_token(istream);
+    if (curr_token.type == token_type::keyword) {
+        if (curr_token.contents == "true")
+            return true;
+        if (curr_token.contents == "false")
+            return false;
+    }
+    throw ParsingException("Expected 'true' or 'false'");
+}
+
 unsigned parse_integer(std::istream& istream)
 {
     Token curr_token = get_next_token(istream);
@@ -10,14 +10,24 @@
  */
 
 #include "fractals.hpp"
+#include "cycles.hpp"
 #include "function_parser.hpp"
+#include "interval.hpp"
+#include "jit.hpp"
+#include "kernels.hpp"
+#include "native.hpp"
+#include "packet.hpp"
 
 #include <algorithm>
 #include <array>
+#include <cmath>
 #include <exception>
+#include <memory>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace fractals
@@ -26,6 +36,125 @@ namespace fractals
 namespace options
 {
 
+/*
+ * Given the lower left and upper right corners of a rectangle of test
+ * points, returns true and sets the last argument to the result if it is
+ * the same for every point in the rectangle (see interval.hpp), false if
+ * that can't be shown.
+ */
+template <typename cmplx>
+using box_function = std::function<bool(const cmplx&, const cmplx&,
+                                        unsigned&)>;
+
+// Ways of evaluating the test function; 'automatic' picks the fastest one
+// available.
+enum class backend
+{
+    automatic, bytecode, jit, packet, formula, native
+};
+
+// Ways of visiting the points of the image: every point, row by row, by
+// rectangle subdivision (see subdivide.hpp), in passes from coarse to fine
+// with a preview saved after each (see progressive.hpp), or skipping what
+// distance estimates show to be outside the Mandelbrot set (see
+// distance.hpp).
+enum class render_strategy
+{
+    rows, subdivide, progressive, distance
+};
+
+/*
+ * Description of the test function from the 'function' option: the backend
+ * chosen for it (never 'automatic') and everything that backend needs.
+ * visit_kernel() below turns one into an object of a concrete kernel type,
+ * so the code testing points can be instantiated for that type and call it
+ * directly instead of through a std::function.
+ *
+ * Every kernel type has two const call operators,
+ *     unsigned operator()(const cmplx& point);
+ *     void operator()(const cmplx& start, real dx, unsigned n, unsigned* out);
+ * the first testing a single point and the second the 'n' points start,
+ * start + dx, start + 2*dx, ... of a row, writing the results to 'out'.
+ */
+template <typename cmplx>
+struct KernelSpec
+{
+    backend be = backend::bytecode;
+    fn_parser::Program<cmplx> program;
+    fn_parser::KnownFormula known{fn_parser::formula::none, 0};
+    cmplx constant;
+    typename cmplx::value_type escape = 0;
+    unsigned max_iters = 0;
+    bool point_is_c = true;
+    // Stop periodic orbits early (see cycles.hpp).
+    bool detect_cycles = false;
+    // The function is the Mandelbrot set's z^2 + c from z = 0, so points in
+    // the main cardioid and period-2 bulb can be settled without iterating.
+    bool skip_main_bulbs = false;
+    // The function with its derivatives, in double precision whatever
+    // cmplx is, for distance estimates (see distance.hpp).
+    fn_parser::DualProgram<std::complex<double>> dual;
+    // Generated code is built when the option file is read, since that
+    // takes a while and can fail.
+#ifdef FRACTALS_HAVE_JIT
+    std::shared_ptr<const fn_parser::JitKernel<cmplx>> jit;
+#endif
+#ifdef FRACTALS_HAVE_NATIVE
+    std::shared_ptr<const fn_parser::NativeKernel<cmplx>> native;
+#endif
+};
+
+/*
+ * Call 'visit' with the kernel described by 'spec'. The visitor should be
+ * callable with any kernel type, e.g. a generic lambda.
+ */
+template <typename cmplx, typename Visitor>
+void visit_kernel(const KernelSpec<cmplx>& spec, Visitor&& visit);
+
+/*
+ * The 'function' option: the kernel plus, if interval checks were asked
+ * for, a test for whole tiles of box_size x box_size points.
+ *
+ * With 'max_iterations: auto' the iteration limit depends on the domain, so
+ * parse_testfun() leaves the kernel unset and fills in the last three
+ * members instead: 'build' makes the test function for a given limit, and
+ * 'probe' is a kernel to pick the limit with (see choose_max_iterations).
+ */
+template <typename cmplx>
+struct TestFunction
+{
+    KernelSpec<cmplx> kernel;
+    box_function<cmplx> box;
+    unsigned box_size = 0;
+    std::function<TestFunction(unsigned)> build;
+    KernelSpec<cmplx> probe;
+    double iteration_tolerance = 0;
+};
+
+/*
+ * The 'deep_zoom' option: the center of the view, kept as written so none
+ * of its digits are lost, and the distance from it to the left and right
+ * edges of the image (see perturbation.hpp).
+ */
+struct DeepZoom
+{
+    bool enabled = false;
+    std::string center_re;
+    std::string center_im;
+    double radius = 0;
+};
+
+/*
+ * The 'supersample' option: pixels whose iteration count differs from a
+ * neighbour's by more than 'threshold' are sampled samples x samples times
+ * (see supersample.hpp). A single sample means no supersampling.
+ */
+struct Supersampling
+{
+    unsigned samples = 1;
+    unsigned threshold = 0;
+};
+
 /*
  * Type used to return options from parsing an optfile.
  * Each of the options is paired with a bool indicating whether or not that
@@ -38,7 +167,21 @@ struct FractalOptions
     std::string output;
     std::vector<std::pair<unsigned, Color>> colors;
     unsigned numthreads;
-    std::function<unsigned(const cmplx&)> test_function;
+    KernelSpec<cmplx> kernel;
+    // Empty unless tiles of box_size x box_size points are to be checked
+    // as a whole first.
+    box_function<cmplx> test_box;
+    unsigned box_size = 0;
+    // Optional; 'rows' unless given.
+    render_strategy strategy = render_strategy::rows;
+    // Optional; if enabled, only the numbers of points of 'domain' are used.
+    DeepZoom deep_zoom;
+    // Optional; off unless given.
+    Supersampling supersample;
+    // Optional; work stealing unless given.
+    schedule scheduling = schedule::stealing;
+    // Optional; false unless given.
+    bool pin_threads = false;
 };
 
 /*
@@ -100,9 +243,54 @@ unsigned parse_integer(std::istream& istream);
 // Parse a list of colors from the input.
 std::vector<std::pair<unsigned, Color>> parse_colorlist(std::istream& istream);
 
+// Parse the name of a backend from the input.
+backend parse_backend(std::istream& istream);
+
+// Parse the name of a render strategy from the input.
+render_strategy parse_render_strategy(std::istream& istream);
+
+// Parse a number of threads, or 'auto' for as many as there are CPUs
+// available, from the input.
+unsigned parse_num_threads(std::istream& istream);
+
+// Parse the name of a way of scheduling the work from the input.
+schedule parse_schedule(std::istream& istream);
+
+// Parse the center and radius of a deep zoom from the input.
+DeepZoom parse_deep_zoom(std::istream& istream);
+
+// Parse the settings for adaptive supersampling from the input.
+Supersampling parse_supersampling(std::istream& istream);
+
+// Parse 'true' or 'false' from the input.
+bool parse_bool(std::istream& istream);
+
 // Parse the function to test a point from the option file.
 template <typename cmplx>
-std::function<unsigned(const cmplx&)> parse_testfun(std::istream& istream);
+TestFunction<cmplx> parse_testfun(std::istream& istream);
+
+/*
+ * Iteration limit for 'max_iterations: auto': the smallest one that, on a
+ * grid of probe points spread over 'dom', leaves at most the fraction
+ * 'tolerance' of them escaping too late to be told from points that never
+ * escape. 'probe' is run with a limit of 'cap', which the result doesn't
+ * exceed.
+ */
+template <typename cmplx>
+unsigned choose_max_iterations(KernelSpec<cmplx> probe,
+                               const Domain<cmplx>& dom, unsigned cap,
+                               double tolerance);
+
+// Pick the backend for a parsed function (if 'be' is automatic) and set up
+// the kernel.
+template <typename cmplx>
+KernelSpec<cmplx> make_kernel_spec(backend be,
+                                   const fn_parser::Expression& expr,
+                                   const fn_parser::Program<cmplx>& f,
+                                   const cmplx& constant,
+                                   typename cmplx::value_type esc,
+                                   unsigned maxiters, bool point_is_c,
+                                   bool detect_cycles);
 
 
 
@@ -126,6 +314,12 @@ FractalOptions<cmplx> get_options(std::istream& istream)
     FractalOptions<cmplx> options;
     // colors domain num_threads output function
     std::array<bool, 5> got_options = { false };
+    // optional: renderer deep_zoom supersample schedule pin_threads
+    bool got_renderer = false;
+    bool got_supersample = false;
+    bool got_schedule = false;
+    bool got_pin_threads = false;
+    TestFunction<cmplx> testfun;
 
     Token tok = get_next_token(istream);
     while (tok.type != token_type::eof) {
@@ -149,7 +343,7 @@ FractalOptions<cmplx> get_options(std::istream& istream)
         } else if (tok.contents == "num_threads") {
             if (got_options[2])
                 throw ParsingException("Multiple definition of 'num_threads'");
-            options.numthreads = parse_integer(istream);
+            options.numthreads = parse_num_threads(istream);
             got_options[2] = true;
         } else if (tok.contents == "output") {
             if (got_options[3])
@@ -159,8 +353,32 @@ FractalOptions<cmplx> get_options(std::istream& istream)
         } else if (tok.contents == "function") {
             if (got_options[4])
                 throw ParsingException("Multiple definition of 'function'");
-            options.test_function = parse_testfun<cmplx>(istream);
+            testfun = parse_testfun<cmplx>(istream);
             got_options[4] = true;
+        } else if (tok.contents == "renderer") {
+            if (got_renderer)
+                throw ParsingException("Multiple definition of 'renderer'");
+            options.strategy = parse_render_strategy(istream);
+            got_renderer = true;
+        } else if (tok.contents == "deep_zoom") {
+            if (options.deep_zoom.enabled)
+                throw ParsingException("Multiple definition of 'deep_zoom'");
+            options.deep_zoom = parse_deep_zoom(istream);
+        } else if (tok.contents == "supersample") {
+            if (got_supersample)
+                throw ParsingException("Multiple definition of 'supersample'");
+            options.supersample = parse_supersampling(istream);
+            got_supersample = true;
+        } else if (tok.contents == "schedule") {
+            if (got_schedule)
+                throw ParsingException("Multiple definition of 'schedule'");
+            options.scheduling = parse_schedule(istream);
+            got_schedule = true;
+        } else if (tok.contents == "pin_threads") {
+            if (got_pin_threads)
+                throw ParsingException("Multiple definition of 'pin_threads'");
+            options.pin_threads = parse_bool(istream);
+            got_pin_threads = true;
         } else {
             throw ParsingException("Unrecognized option keyword");
         }
@@ -171,6 +389,70 @@ FractalOptions<cmplx> get_options(std::istream& istream)
         [](bool b){return b;}))
         throw ParsingException("Some options not specified");
 
+    if (testfun.build) {
+        if (options.deep_zoom.enabled)
+            throw ParsingException("'max_iterations: auto' can't be used with "
+                                   "'deep_zoom'");
+        // The color scale has to cover the limit.
+        unsigned cap = 0;
+        for (const auto& color : options.colors)
+            cap = std::max(cap, color.first);
+        testfun = testfun.build(choose_max_iterations(
+            testfun.probe, options.domain, cap, testfun.iteration_tolerance));
+    }
+    options.kernel = testfun.kernel;
+    options.test_box = testfun.box;
+    options.box_size = testfun.box_size;
+
+    if (options.strategy == render_strategy::progressive &&
+        options.supersample.samples > 1)
+        throw ParsingException("'supersample' can't be used with the "
+                               "progressive renderer");
+    if (options.strategy == render_strategy::progressive && options.test_box)
+        throw ParsingException("'interval_tiles' can't be used with the "
+                               "progressive renderer");
+
+    if (options.strategy == render_strategy::distance) {
+        const KernelSpec<cmplx>& k = options.kernel;
+        if (k.known.kind != fn_parser::formula::multibrot ||
+            k.known.power != 2 || !k.point_is_c || k.constant != cmplx(0))
+            throw ParsingException("The distance renderer is only available "
+                                   "for z^2 + c from z = 0 with 'point: c'");
+        if (!(k.escape >= 2))
+            throw ParsingException("The distance renderer needs an escape_tol "
+                                   "of at least 2");
+    }
+
+    if (options.deep_zoom.enabled) {
+        // The perturbation renderer has its own loop over the image and its
+        // own iteration, which none of these options affect.
+        if (got_renderer)
+            throw ParsingException("'renderer' can't be used with "
+                                   "'deep_zoom'");
+        if (got_supersample)
+            throw ParsingException("'supersample' can't be used with "
+                                   "'deep_zoom'");
+        if (got_schedule)
+            throw ParsingException("'schedule' can't be used with "
+                                   "'deep_zoom'");
+        if (options.test_box)
+            throw ParsingException("'interval_tiles' can't be used with "
+                                   "'deep_zoom'");
+        if (options.kernel.detect_cycles)
+            throw ParsingException("'periodicity' can't be used with "
+                                   "'deep_zoom'");
+        const KernelSpec<cmplx>& k = options.kernel;
+        if (k.known.kind != fn_parser::formula::multibrot ||
+            k.known.power != 2 || !k.point_is_c)
+            throw ParsingException("'deep_zoom' is only available for z^2 + c "
+                                   "with 'point: c'");
+        // The reference orbit's fixed point numbers have a 32 bit integer
+        // part.
+        if (!(k.escape <= 65536))
+            throw ParsingException("'deep_zoom' needs an escape_tol of at most "
+                                   "65536");
+    }
+
     return options;
 }
 
@@ -251,8 +533,26 @@ cmplx parse_constant(std::istream& istream, parser_internal flag)
     return cmplx(x, y);
 }
 
+/*
+ * Brent's cycle check for the loops below: whether 'z', the iterate after
+ * 'iters' iterations, repeats 'saved', which is updated at the checkpoints.
+ */
+template <typename cmplx>
+bool is_cycle(const cmplx& z, cmplx& saved, unsigned iters)
+{
+    using real = typename cmplx::value_type;
+    if (std::abs(z.real() - saved.real()) + std::abs(z.imag() - saved.imag()) <
+        fn_parser::cycle_tolerance<real>())
+        return true;
+    if (fn_parser::cycle_checkpoint(iters))
+        saved = z;
+    return false;
+}
+
 // These two function objects are instantiated to provide the two types
-// of test functions we allow.
+// of test functions we allow. The function being iterated is run as a
+// bytecode program (see bytecode.hpp). If 'detect_cycles' is set, periodic
+// orbits are stopped early (see cycles.hpp).
 template <typename cmplx>
 class ztestfun
 {
@@ -260,19 +560,29 @@ private:
     const cmplx constant;
     const typename cmplx::value_type escape;
     const unsigned max_iters;
-    const fn_parser::fn<cmplx> func;
+    const fn_parser::Program<cmplx> func;
+    // c is the same for the whole image, so the parts of the function that
+    // only depend on it are evaluated once, here.
+    const std::vector<cmplx> init;
+    const bool detect_cycles;
 public:
     ztestfun(const cmplx& c, const typename cmplx::value_type& e, unsigned m,
-             const fn_parser::fn<cmplx>& f) : constant(c), escape(e), 
-             max_iters(m), func(f) {}
+             const fn_parser::Program<cmplx>& f, bool d = false) :
+             constant(c), escape(e), max_iters(m), func(f),
+             init(f.initial_registers(c)), detect_cycles(d) {}
     
-    unsigned operator()(const cmplx& z)
+    unsigned operator()(const cmplx& z) const
     {
+        fn_parser::RegisterFile<cmplx> regs(init);
         unsigned iters = 0;
         cmplx test = z;
+        cmplx saved = test;
         while (abs(test) < escape && iters < max_iters) {
-            test = func(test, constant);
+            regs[func.z_register] = test;
+            test = func.step(regs.data());
             iters += 1;
+            if (detect_cycles && is_cycle(test, saved, iters))
+                return 0;
         }
         return iters == max_iters ? 0 : iters;
     }
@@ -285,26 +595,226 @@ private:
     const cmplx constant;
     const typename cmplx::value_type escape;
     const unsigned max_iters;
-    const fn_parser::fn<cmplx> func;
+    const fn_parser::Program<cmplx> func;
+    const bool detect_cycles;
 public:
     ctestfun(const cmplx& c, const typename cmplx::value_type& e, unsigned m,
-             const fn_parser::fn<cmplx>& f) : constant(c), escape(e), 
-             max_iters(m), func(f) {}
+             const fn_parser::Program<cmplx>& f, bool d = false) :
+             constant(c), escape(e), max_iters(m), func(f),
+             detect_cycles(d) {}
     
-    unsigned operator()(const cmplx& c)
+    unsigned operator()(const cmplx& c) const
     {
+        fn_parser::RegisterFile<cmplx> regs(func);
+        regs[func.c_register] = c;
+        func.setup(regs.data());
         unsigned iters = 0;
         cmplx test = constant;
+        cmplx saved = test;
         while (abs(test) < escape && iters < max_iters) {
-            test = func(test, c);
+            regs[func.z_register] = test;
+            test = func.step(regs.data());
             iters += 1;
+            if (detect_cycles && is_cycle(test, saved, iters))
+                return 0;
         }
         return iters == max_iters ? 0 : iters;
     }
 };
 
+// Adapts a kernel testing single points to test rows of points.
+template <typename cmplx, typename Point>
+struct point_rows
+{
+    Point point;
+
+    unsigned operator()(const cmplx& p) const
+    {
+        return point(p);
+    }
+
+    void operator()(const cmplx& start, typename cmplx::value_type dx,
+                    unsigned n, unsigned* out) const
+    {
+        for (unsigned j = 0; j < n; ++j)
+            out[j] = point(cmplx(start.real() + j*dx, start.imag()));
+    }
+};
+
+/*
+ * Puts the closed form test for the main cardioid and period-2 bulb of the
+ * Mandelbrot set (fn_parser::in_main_bulbs) in front of another kernel.
+ * Points inside them are reported as not escaping straight away; rows are
+ * split into the runs of points outside them, which are passed on to the
+ * kernel as shorter rows.
+ */
+template <typename cmplx, typename Kernel>
+struct main_bulbs_filter
+{
+    Kernel kernel;
+
+    static bool inside(const cmplx& p)
+    {
+        return fn_parser::in_main_bulbs(double(p.real()), double(p.imag()));
+    }
+
+    unsigned operator()(const cmplx& p) const
+    {
+        return inside(p) ? 0 : kernel(p);
+    }
+
+    void operator()(const cmplx& start, typename cmplx::value_type dx,
+                    unsigned n, unsigned* out) const
+    {
+        unsigned j = 0;
+        while (j < n) {
+            const cmplx p(start.real() + j*dx, start.imag());
+            if (inside(p)) {
+                out[j++] = 0;
+                continue;
+            }
+            unsigned k = j + 1;
+            while (k < n && !inside(cmplx(start.real() + k*dx, start.imag())))
+                ++k;
+            kernel(p, dx, k - j, out + j);
+            j = k;
+        }
+    }
+};
+
+template <typename cmplx, typename Step, typename Visitor>
+void visit_formula_kernel(const KernelSpec<cmplx>& spec, const Step& step,
+                          Visitor& visit)
+{
+    if (spec.point_is_c)
+        visit(fn_parser::FormulaKernel<cmplx, Step, true>(
+            step, spec.constant, spec.escape, spec.max_iters,
+            spec.detect_cycles));
+    else
+        visit(fn_parser::FormulaKernel<cmplx, Step, false>(
+            step, spec.constant, spec.escape, spec.max_iters,
+            spec.detect_cycles));
+}
+
+// The hand-written kernel for a recognized formula.
+template <typename cmplx, typename Visitor>
+void visit_formula_kernel(const KernelSpec<cmplx>& spec, Visitor& visit)
+{
+    using real = typename cmplx::value_type;
+    const fn_parser::KnownFormula& known = spec.known;
+    switch (known.kind) {
+    case fn_parser::formula::multibrot:
+        if (known.power == 2)
+            visit_formula_kernel(spec, fn_parser::quadratic_step<real>{}, visit);
+        else if (known.power == 3)
+            visit_formula_kernel(spec, fn_parser::cubic_step<real>{}, visit);
+        else
+            visit_formula_kernel(spec, fn_parser::power_step<real>{known.power},
+                                 visit);
+        break;
+    case fn_parser::formula::tricorn:
+        if (known.power == 2)
+            visit_formula_kernel(spec, fn_parser::tricorn_step<real>{}, visit);
+        else
+            visit_formula_kernel(
+                spec, fn_parser::tricorn_power_step<real>{known.power}, visit);
+        break;
+    default:
+        visit_formula_kernel(spec, fn_parser::logistic_step<real>{}, visit);
+        break;
+    }
+}
+
+// The kernel for the backend of 'spec', without any filter in front.
+template <typename cmplx, typename Visitor>
+void visit_backend(const KernelSpec<cmplx>& spec, Visitor& visit)
+{
+    switch (spec.be) {
+    case backend::formula:
+        visit_formula_kernel(spec, visit);
+        return;
+    case backend::packet:
+        visit(fn_parser::PacketKernel<cmplx>(spec.program, spec.constant,
+                                             spec.escape, spec.max_iters,
+                                             spec.point_is_c,
+                                             spec.detect_cycles));
+        return;
+#ifdef FRACTALS_HAVE_JIT
+    case backend::jit:
+        visit(point_rows<cmplx, fn_parser::JitKernel<cmplx>>{*spec.jit});
+        return;
+#endif
+#ifdef FRACTALS_HAVE_NATIVE
+    case backend::native:
+        visit(*spec.native);
+        return;
+#endif
+    default:
+        break;
+    }
+    if (spec.point_is_c)
+        visit(point_rows<cmplx, ctestfun<cmplx>>{ctestfun<cmplx>(
+            spec.constant, spec.escape, spec.max_iters, spec.program,
+            spec.detect_cycles)});
+    else
+        visit(point_rows<cmplx, ztestfun<cmplx>>{ztestfun<cmplx>(
+            spec.constant, spec.escape, spec.max_iters, spec.program,
+            spec.detect_cycles)});
+}
+
+template <typename cmplx, typename Visitor>
+void visit_kernel(const KernelSpec<cmplx>& spec, Visitor&& visit)
+{
+    if (!spec.skip_main_bulbs) {
+        visit_backend(spec, visit);
+        return;
+    }
+    auto filtered = [&](const auto& kernel)
+    {
+        using Kernel = std::decay_t<decltype(kernel)>;
+        visit(main_bulbs_filter<cmplx, Kernel>{kernel});
+    };
+    visit_backend(spec, filtered);
+}
+
+#ifdef FRACTALS_HAVE_JIT
+template <typename cmplx>
+void build_jit_kernel(KernelSpec<cmplx>& spec, std::true_type)
+{
+    spec.jit = std::make_shared<fn_parser::JitKernel<cmplx>>(
+        spec.program, spec.constant, spec.escape, spec.max_iters,
+        spec.point_is_c);
+}
+#endif
+
+template <typename cmplx>
+void build_jit_kernel(KernelSpec<cmplx>&, std::false_type)
+{
+    throw ParsingException("The 'jit' backend is not available for this "
+                           "platform or number type");
+}
+
+// Build (or fetch from the cache) a kernel compiled by the system compiler.
 template <typename cmplx>
-std::function<unsigned(const cmplx&)> parse_testfun(std::istream& istream)
+void build_native_kernel(KernelSpec<cmplx>& spec,
+                         const fn_parser::Expression& expr)
+{
+#ifdef FRACTALS_HAVE_NATIVE
+    try {
+        spec.native = std::make_shared<fn_parser::NativeKernel<cmplx>>(
+            expr, spec.constant, spec.escape, spec.max_iters,
+            spec.point_is_c);
+    } catch (const std::runtime_error& err) {
+        throw ParsingException(err.what());
+    }
+#else
+    throw ParsingException("The 'native' backend is not available on this "
+                           "platform");
+#endif
+}
+
+template <typename cmplx>
+TestFunction<cmplx> parse_testfun(std::istream& istream)
 {
     Token curr_token = get_next_token(istream);
     if (curr_token.type != token_type::symbol || curr_token.contents != "{")
@@ -314,7 +824,9 @@ std::function<unsigned(const cmplx&)> parse_testfun(std::istream& istream)
     if (curr_token.type != token_type::string)
         throw ParsingException("Expected string giving function definition");
     
-    auto f = fn_parser::FunctionParser(curr_token.contents).get<cmplx>();
+    fn_parser::FunctionParser parser(curr_token.contents);
+    const auto& expr = parser.get_expression();
+    const fn_parser::Program<cmplx> f(expr);
     curr_token = get_next_token(istream);
     if (curr_token.type != token_type::symbol || curr_token.contents != ",")
         throw ParsingException("Missing delimiting ',' in function definition");
@@ -326,7 +838,16 @@ std::function<unsigned(const cmplx&)> parse_testfun(std::istream& istream)
     curr_token = get_next_token(istream);
     if (curr_token.type != token_type::symbol || curr_token.contents != ":")
         throw ParsingException("Missing ':' delimiter after 'max_iterations'");
-    unsigned maxiters = parse_integer(istream);
+    curr_token = get_next_token(istream);
+    const bool auto_iters = curr_token.type == token_type::keyword &&
+                            curr_token.contents == "auto";
+    unsigned maxiters = 0;
+    if (!auto_iters) {
+        if (curr_token.type != token_type::integer)
+            throw ParsingException("Expected an integer or 'auto' for "
+                                   "'max_iterations'");
+        std::istringstream(curr_token.contents) >> maxiters;
+    }
     curr_token = get_next_token(istream);
     if (curr_token.type != token_type::symbol || curr_token.contents != ",")
         throw ParsingException("Missing ',' delimiter");
@@ -368,17 +889,168 @@ std::function<unsigned(const cmplx&)> parse_testfun(std::istream& istream)
         (curr_token.contents != "c" && curr_token.contents != "z"))
         throw ParsingException("Bad point specification - expect 'z' or 'c'");
     
-    std::function<unsigned(const cmplx&)> testfun;
-    if (curr_token.contents == "c")
-        testfun = ctestfun<cmplx>(constant, esc, maxiters, f);
-    else 
-        testfun = ztestfun<cmplx>(constant, esc, maxiters, f);
+    const bool point_is_c = curr_token.contents == "c";
+
+    // Optional settings follow, in any order.
+    backend be = backend::automatic;
+    unsigned interval_tiles = 0;
+    bool periodicity = false;
+    double iteration_tolerance = 1e-3;
     curr_token = get_next_token(istream);
+    while (curr_token.type == token_type::symbol && curr_token.contents == ",") {
+        Token key = get_next_token(istream);
+        if (key.type != token_type::keyword)
+            throw ParsingException("Expected a keyword after ',' in function "
+                                   "definition");
+        curr_token = get_next_token(istream);
+        if (curr_token.type != token_type::symbol || curr_token.contents != ":")
+            throw ParsingException("Missing ':' delimiter after '" +
+                                   key.contents + "'");
+        if (key.contents == "backend") {
+            be = parse_backend(istream);
+        } else if (key.contents == "interval_tiles") {
+            interval_tiles = parse_integer(istream);
+        } else if (key.contents == "periodicity") {
+            periodicity = parse_bool(istream);
+        } else if (key.contents == "iteration_tolerance") {
+            Token value = get_next_token(istream);
+            if (value.type != token_type::floating &&
+                value.type != token_type::integer)
+                throw ParsingException("Expected a number for "
+                                       "'iteration_tolerance'");
+            std::istringstream(value.contents) >> iteration_tolerance;
+            if (!(iteration_tolerance >= 0 && iteration_tolerance < 1))
+                throw ParsingException("'iteration_tolerance' must be at "
+                                       "least 0 and less than 1");
+        } else {
+            throw ParsingException("Unrecognized function setting '" +
+                                   key.contents + "'");
+        }
+        curr_token = get_next_token(istream);
+    }
     if (curr_token.type != token_type::symbol || curr_token.contents != "}")
         throw ParsingException("Missing closing '}' in function definition");
+
+    if (interval_tiles == 1 || (interval_tiles > 0 &&
+                                !fn_parser::interval_supported(f)))
+        throw ParsingException("Interval checks need a tile size of at least "
+                               "2 and a function without tan, asin, acos, "
+                               "atan, sqrt or non-integer powers");
+
+    auto build = [=](unsigned iters)
+    {
+        TestFunction<cmplx> testfun;
+        testfun.kernel = make_kernel_spec(be, expr, f, constant, esc, iters,
+                                          point_is_c, periodicity);
+        if (interval_tiles > 0) {
+            testfun.box = fn_parser::IntervalTest<cmplx>(f, constant, esc,
+                                                         iters, point_is_c);
+            testfun.box_size = interval_tiles;
+        }
+        return testfun;
+    };
+    if (!auto_iters)
+        return build(maxiters);
+
+    // Points that never escape are mostly caught by the cycle check, so the
+    // probe doesn't cost a full iteration limit for each of them.
+    TestFunction<cmplx> testfun;
+    testfun.build = build;
+    testfun.probe = make_kernel_spec(backend::automatic, expr, f, constant,
+                                     esc, 0, point_is_c, true);
+    testfun.iteration_tolerance = iteration_tolerance;
     return testfun;
 }
 
+template <typename cmplx>
+unsigned choose_max_iterations(KernelSpec<cmplx> probe,
+                               const Domain<cmplx>& dom, unsigned cap,
+                               double tolerance)
+{
+    // Number of probe points in each direction.
+    constexpr unsigned probe_size = 64;
+    const unsigned across = std::min(probe_size, dom.nacross);
+    const unsigned up = std::min(probe_size, dom.nup);
+    const auto dx = across > 1 ?
+        (dom.upper_right.real() - dom.lower_left.real()) / (across - 1) : 0;
+    const auto dy = up > 1 ?
+        (dom.upper_right.imag() - dom.lower_left.imag()) / (up - 1) : 0;
+
+    probe.max_iters = cap;
+    std::vector<unsigned> counts(across * up);
+    visit_kernel(probe, [&](const auto& kernel)
+    {
+        for (unsigned i = 0; i < up; ++i)
+            kernel(cmplx(dom.lower_left.real(), dom.lower_left.imag() + i*dy),
+                   dx, across, &counts[i*across]);
+    });
+
+    std::vector<unsigned> escaped;
+    for (unsigned n : counts)
+        if (n != 0)
+            escaped.push_back(n);
+    if (escaped.empty())
+        return cap;
+    std::sort(escaped.begin(), escaped.end());
+
+    // A point escaping after n iterations needs a limit of at least n + 1.
+    const unsigned allowed = tolerance * counts.size();
+    if (allowed >= escaped.size())
+        return std::min(cap, escaped.front() + 1);
+    return std::min(cap, escaped[escaped.size() - 1 - allowed] + 1);
+}
+
+template <typename cmplx>
+KernelSpec<cmplx> make_kernel_spec(backend be,
+                                   const fn_parser::Expression& expr,
+                                   const fn_parser::Program<cmplx>& f,
+                                   const cmplx& constant,
+                                   typename cmplx::value_type esc,
+                                   unsigned maxiters, bool point_is_c,
+                                   bool detect_cycles)
+{
+    KernelSpec<cmplx> spec;
+    spec.program = f;
+    spec.dual = fn_parser::DualProgram<std::complex<double>>(
+        fn_parser::Program<std::complex<double>>(expr));
+    spec.known = fn_parser::recognize(expr);
+    spec.constant = constant;
+    spec.escape = esc;
+    spec.max_iters = maxiters;
+    spec.point_is_c = point_is_c;
+    spec.detect_cycles = detect_cycles;
+    // Orbits from inside the main cardioid and bulb stay within |z| <= 2,
+    // so they don't escape for any escape_tol of at least 2. That only holds
+    // for z^2 + c itself, so it's checked for exactly.
+    spec.skip_main_bulbs = fn_parser::is_mandelbrot(expr) && point_is_c &&
+                           constant == cmplx(0) && esc >= 2;
+
+    if (be == backend::formula && spec.known.kind == fn_parser::formula::none)
+        throw ParsingException("The 'formula' backend was requested but the "
+                               "function isn't one with a built in kernel");
+
+    if (be == backend::automatic) {
+        if (spec.known.kind != fn_parser::formula::none)
+            be = backend::formula;
+        else if (fn_parser::vectorizes(f))
+            be = backend::packet;
+        else if (fn_parser::jit_supported<cmplx>::value && !detect_cycles)
+            be = backend::jit;
+        else
+            be = backend::bytecode;
+    }
+    spec.be = be;
+    if (detect_cycles && (be == backend::jit || be == backend::native))
+        throw ParsingException("Periodicity checks aren't available with the "
+                               "'jit' and 'native' backends");
+
+    if (be == backend::jit)
+        build_jit_kernel(spec, fn_parser::jit_supported<cmplx>());
+    else if (be == backend::native)
+        build_native_kernel(spec, expr);
+    return spec;
+}
+
 } /* namespace options */
 
 } /* namespace fractals */
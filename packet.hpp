@@ -0,0 +1,307 @@
+#pragma once
+
+/*
+ * Evaluation of the escape time loop on packets of points at once.
+ *
+ * PacketKernel runs a bytecode Program (see bytecode.hpp) on 'width' test
+ * points together. Every register holds the real and imaginary parts of all
+ * lanes as separate arrays, so each instruction is a short loop over the
+ * lanes that the compiler turns into SSE2/AVX2/AVX-512 arithmetic; 'width' is
+ * picked from the widest vector unit the program is compiled for. Each lane
+ * has its own iteration counter and stops being updated (through a mask)
+ * once it escapes, and a packet is finished when all of its lanes are.
+ *
+ * Packets are filled from consecutive points of a row, which is how the
+ * point checker in main.cpp hands out work anyway.
+ */
+
+#include "bytecode.hpp"
+#include "cycles.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+namespace fractals {
+
+namespace fn_parser {
+
+// Size in bytes of the vector registers we're compiling for.
+constexpr unsigned simd_bytes =
+#if defined(__AVX512F__)
+    64;
+#elif defined(__AVX__)
+    32;
+#else
+    16;
+#endif
+
+/*
+ * Whether all of the instructions a program runs on every iteration have
+ * vector implementations. The transcendental functions are evaluated one lane
+ * at a time, so programs using them in the loop gain little from packets;
+ * the setup part (see bytecode.hpp) only runs once per packet and doesn't
+ * matter.
+ */
+template <typename cmplx>
+bool vectorizes(const Program<cmplx>& prog)
+{
+    const auto& code = prog.instructions();
+    for (unsigned i = prog.setup_size(); i < code.size(); ++i) {
+        switch (code[i].code) {
+        case op::NEG: case op::ADD: case op::SUB: case op::MUL: case op::DIV:
+        case op::SQUARE: case op::REAL: case op::IMAG: case op::CONJ:
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename cmplx>
+class PacketKernel
+{
+public:
+    using real = typename cmplx::value_type;
+
+    static constexpr unsigned width =
+        sizeof(real) < simd_bytes ? simd_bytes / sizeof(real) : 1;
+
+    // 'point_is_c' selects between the two modes of operation: the test
+    // point is c and 'constant' is the initial z, or the other way around.
+    // With 'detect_cycles' periodic orbits are stopped early (cycles.hpp).
+    PacketKernel(const Program<cmplx>& prog, const cmplx& constant,
+                 real escape, unsigned max_iters, bool point_is_c,
+                 bool detect_cycles = false) :
+        prog_(prog), constant_(constant), escape2_(escape * escape),
+        max_iters_(max_iters), point_is_c_(point_is_c),
+        detect_cycles_(detect_cycles) {}
+
+    /*
+     * Test the 'n' points start, start + dx, start + 2*dx, ... and write the
+     * iteration counts (0 for points that didn't escape) to 'out'.
+     */
+    void operator()(const cmplx& start, real dx, unsigned n,
+                    unsigned* out) const;
+
+    // Test a single point.
+    unsigned operator()(const cmplx& point) const
+    {
+        unsigned result;
+        (*this)(point, real(0), 1, &result);
+        return result;
+    }
+
+private:
+    struct Lanes
+    {
+        real re[width];
+        real im[width];
+    };
+
+    Program<cmplx> prog_;
+    cmplx constant_;
+    real escape2_;
+    unsigned max_iters_;
+    bool point_is_c_;
+    bool detect_cycles_;
+
+    void run(Lanes* regs, unsigned first, unsigned last) const;
+    void iterate(Lanes* regs, unsigned* counts) const;
+};
+
+template <typename cmplx>
+constexpr unsigned PacketKernel<cmplx>::width;
+
+template <typename cmplx>
+void PacketKernel<cmplx>::operator()(const cmplx& start, real dx, unsigned n,
+                                     unsigned* out) const
+{
+    using P = Program<cmplx>;
+    const auto& init = prog_.initial_registers();
+    std::vector<Lanes> regs(init.size());
+    for (unsigned r = 0; r < init.size(); ++r) {
+        std::fill_n(regs[r].re, width, init[r].real());
+        std::fill_n(regs[r].im, width, init[r].imag());
+    }
+    const unsigned point_reg = point_is_c_ ? P::c_register : P::z_register;
+    const unsigned const_reg = point_is_c_ ? P::z_register : P::c_register;
+    // The setup part of the program only depends on c, so it's run once for
+    // the row if c is the constant and once per packet otherwise.
+    if (!point_is_c_) {
+        std::fill_n(regs[const_reg].re, width, constant_.real());
+        std::fill_n(regs[const_reg].im, width, constant_.imag());
+        run(regs.data(), 0, prog_.setup_size());
+    }
+
+    unsigned counts[width];
+    for (unsigned first = 0; first < n; first += width) {
+        // A partial packet at the end of the row repeats its last point.
+        for (unsigned l = 0; l < width; ++l) {
+            unsigned j = std::min(first + l, n - 1);
+            regs[point_reg].re[l] = start.real() + j*dx;
+            regs[point_reg].im[l] = start.imag();
+        }
+        if (point_is_c_) {
+            std::fill_n(regs[const_reg].re, width, constant_.real());
+            std::fill_n(regs[const_reg].im, width, constant_.imag());
+            run(regs.data(), 0, prog_.setup_size());
+        }
+
+        iterate(regs.data(), counts);
+        for (unsigned l = 0; l < width && first + l < n; ++l)
+            out[first + l] = counts[l];
+    }
+}
+
+template <typename cmplx>
+void PacketKernel<cmplx>::iterate(Lanes* regs, unsigned* counts) const
+{
+    using P = Program<cmplx>;
+    Lanes& z = regs[P::z_register];
+    const Lanes& result = regs[prog_.result_register()];
+    const real tolerance = cycle_tolerance<real>();
+
+    Lanes saved = z;
+    unsigned periodic[width];
+    std::fill_n(counts, width, 0u);
+    std::fill_n(periodic, width, 0u);
+    for (unsigned iter = 0; iter < max_iters_; ++iter) {
+        unsigned active[width];
+        unsigned any = 0;
+        for (unsigned l = 0; l < width; ++l) {
+            active[l] = !periodic[l] &&
+                        z.re[l]*z.re[l] + z.im[l]*z.im[l] < escape2_;
+            any |= active[l];
+        }
+        if (!any)
+            break;
+
+        run(regs, prog_.setup_size(), prog_.instructions().size());
+        for (unsigned l = 0; l < width; ++l) {
+            z.re[l] = active[l] ? result.re[l] : z.re[l];
+            z.im[l] = active[l] ? result.im[l] : z.im[l];
+            counts[l] += active[l];
+        }
+        if (detect_cycles_) {
+            for (unsigned l = 0; l < width; ++l)
+                periodic[l] |= active[l] &&
+                    std::abs(z.re[l] - saved.re[l]) +
+                    std::abs(z.im[l] - saved.im[l]) < tolerance;
+            if (cycle_checkpoint(iter + 1))
+                saved = z;
+        }
+    }
+    for (unsigned l = 0; l < width; ++l)
+        counts[l] = periodic[l] || counts[l] == max_iters_ ? 0 : counts[l];
+}
+
+namespace {
+
+    template <typename cmplx>
+    cmplx apply_one(op code, const cmplx& a, const cmplx& b)
+    {
+        switch (code) {
+        case op::POW: return std::pow(a, b);
+        case op::ABS: return cmplx(std::abs(a));
+        case op::EXP: return std::exp(a);
+        case op::SIN: return std::sin(a);
+        case op::COS: return std::cos(a);
+        case op::TAN: return std::tan(a);
+        case op::ASIN: return std::asin(a);
+        case op::ACOS: return std::acos(a);
+        case op::ATAN: return std::atan(a);
+        case op::SQRT: return std::sqrt(a);
+        default: return a;
+        }
+    }
+
+}
+
+template <typename cmplx>
+void PacketKernel<cmplx>::run(Lanes* regs, unsigned first,
+                              unsigned last) const
+{
+    for (unsigned i = first; i < last; ++i) {
+        const Instruction& ins = prog_.instructions()[i];
+        const Lanes& a = regs[ins.a];
+        const Lanes& b = regs[ins.b];
+        // Results go to a local first; otherwise the compiler has to assume
+        // the destination might overlap the operands and won't vectorize.
+        Lanes t;
+        switch (ins.code) {
+        case op::NEG:
+            for (unsigned l = 0; l < width; ++l) {
+                t.re[l] = -a.re[l];
+                t.im[l] = -a.im[l];
+            }
+            break;
+        case op::ADD:
+            for (unsigned l = 0; l < width; ++l) {
+                t.re[l] = a.re[l] + b.re[l];
+                t.im[l] = a.im[l] + b.im[l];
+            }
+            break;
+        case op::SUB:
+            for (unsigned l = 0; l < width; ++l) {
+                t.re[l] = a.re[l] - b.re[l];
+                t.im[l] = a.im[l] - b.im[l];
+            }
+            break;
+        case op::MUL:
+            for (unsigned l = 0; l < width; ++l) {
+                t.re[l] = a.re[l]*b.re[l] - a.im[l]*b.im[l];
+                t.im[l] = a.re[l]*b.im[l] + a.im[l]*b.re[l];
+            }
+            break;
+        case op::DIV:
+            for (unsigned l = 0; l < width; ++l) {
+                real den = b.re[l]*b.re[l] + b.im[l]*b.im[l];
+                t.re[l] = (a.re[l]*b.re[l] + a.im[l]*b.im[l]) / den;
+                t.im[l] = (a.im[l]*b.re[l] - a.re[l]*b.im[l]) / den;
+            }
+            break;
+        case op::SQUARE:
+            for (unsigned l = 0; l < width; ++l) {
+                t.re[l] = a.re[l]*a.re[l] - a.im[l]*a.im[l];
+                t.im[l] = 2*a.re[l]*a.im[l];
+            }
+            break;
+        case op::REAL:
+            for (unsigned l = 0; l < width; ++l) {
+                t.re[l] = a.re[l];
+                t.im[l] = 0;
+            }
+            break;
+        case op::IMAG:
+            for (unsigned l = 0; l < width; ++l) {
+                t.re[l] = 0;
+                t.im[l] = a.im[l];
+            }
+            break;
+        case op::CONJ:
+            for (unsigned l = 0; l < width; ++l) {
+                t.re[l] = a.re[l];
+                t.im[l] = -a.im[l];
+            }
+            break;
+        default:
+            // No vector versions of the transcendental functions; these
+            // are done a lane at a time.
+            for (unsigned l = 0; l < width; ++l) {
+                cmplx w = apply_one(ins.code, cmplx(a.re[l], a.im[l]),
+                                    cmplx(b.re[l], b.im[l]));
+                t.re[l] = w.real();
+                t.im[l] = w.imag();
+            }
+            break;
+        }
+        regs[ins.dst] = t;
+    }
+}
+
+}
+
+}
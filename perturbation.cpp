@@ -0,0 +1,216 @@
+#include "perturbation.hpp"
+#include "bigfixed.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace fractals
+{
+
+namespace
+{
+
+using dcomplex = std::complex<double>;
+
+// |z_n| below this fraction of |Z_n| counts as a glitch.
+constexpr double glitch_tolerance = 1e-3;
+
+// The series approximation is used while its cubic term, over the whole
+// image, stays below this fraction of the linear one.
+constexpr double series_tolerance = 1e-12;
+
+// Most references computed for one image.
+constexpr unsigned max_references = 64;
+
+// Marks pixels that need a new reference.
+constexpr unsigned glitched = std::numeric_limits<unsigned>::max();
+
+// Bits beyond those needed to tell the pixels apart.
+constexpr unsigned guard_bits = 64;
+
+/*
+ * The orbit of one reference point, at 'offset' from the center of the
+ * image, and the series approximation for the pixels around it.
+ */
+struct Reference
+{
+    dcomplex offset;
+    std::vector<dcomplex> orbit;
+    // Iterations skipped with the series, and its coefficients there.
+    unsigned skip = 0;
+    dcomplex a, b, c;
+};
+
+/*
+ * Iterate the reference point in high precision until it escapes or
+ * 'max_iters' iterations, then work out the series approximation for
+ * pixels up to 'radius' away from it.
+ */
+Reference make_reference(const BigFixed& center_re, const BigFixed& center_im,
+                         const dcomplex& offset, const dcomplex& z0,
+                         double escape, unsigned max_iters, double radius)
+{
+    const unsigned limbs = center_re.size();
+    const BigFixed cre = center_re + BigFixed(offset.real(), limbs);
+    const BigFixed cim = center_im + BigFixed(offset.imag(), limbs);
+    BigFixed zre(z0.real(), limbs), zim(z0.imag(), limbs);
+
+    Reference ref;
+    ref.offset = offset;
+    const double escape2 = escape * escape;
+    for (unsigned n = 0; ; ++n) {
+        const dcomplex z(zre.to_double(), zim.to_double());
+        ref.orbit.push_back(z);
+        if (n == max_iters || std::norm(z) >= escape2)
+            break;
+        BigFixed t = zre*zre - zim*zim + cre;
+        zim = zre*zim;
+        zim *= 2;
+        zim = zim + cim;
+        zre = t;
+    }
+
+    // d_0 = 0, so all of the coefficients start at 0.
+    dcomplex a = 0, b = 0, c = 0;
+    for (unsigned n = 0; n + 1 < ref.orbit.size(); ++n) {
+        const dcomplex two_z = 2.0 * ref.orbit[n];
+        const dcomplex na = two_z * a + 1.0;
+        const dcomplex nb = two_z * b + a * a;
+        const dcomplex nc = two_z * c + 2.0 * a * b;
+        // Stop short of where the cubic term matters, or where some pixel
+        // might already have escaped.
+        const double r = radius;
+        const double bound = std::abs(na) * r + std::abs(nb) * r * r +
+                             std::abs(nc) * r * r * r;
+        if (!(std::abs(nc) * r * r < series_tolerance * std::abs(na)) ||
+            !(std::abs(ref.orbit[n + 1]) + bound < escape))
+            break;
+        a = na;
+        b = nb;
+        c = nc;
+        ref.skip = n + 1;
+    }
+    ref.a = a;
+    ref.b = b;
+    ref.c = c;
+    return ref;
+}
+
+/*
+ * Iteration count for the pixel at 'dc' from the reference point, or
+ * 'glitched' if the reference can't be trusted for it and 'check' is set.
+ */
+unsigned iterate(const Reference& ref, const dcomplex& dc, double escape,
+                 unsigned max_iters, bool check)
+{
+    const double escape2 = escape * escape;
+    const double glitch2 = glitch_tolerance * glitch_tolerance;
+    unsigned n = ref.skip;
+    dcomplex d = ((ref.c * dc + ref.b) * dc + ref.a) * dc;
+    while (true) {
+        const dcomplex& z_ref = ref.orbit[n];
+        const dcomplex z = z_ref + d;
+        if (n == max_iters)
+            return 0;
+        const double r2 = std::norm(z);
+        if (r2 >= escape2)
+            return n;
+        if (n + 1 == ref.orbit.size())
+            return check ? glitched : 0;
+        if (check && r2 < glitch2 * std::norm(z_ref))
+            return glitched;
+        d = (2.0 * z_ref + d) * d + dc;
+        ++n;
+    }
+}
+
+// Run 'work(k)' for k in [0, n), split between the threads of 'pool'.
+template <typename F>
+void parallel_for(unsigned n, ThreadPool& pool, const F& work)
+{
+    const unsigned num_threads = pool.size();
+    pool.run([&](unsigned t)
+    {
+        for (unsigned k = t; k < n; k += num_threads)
+            work(k);
+    });
+}
+
+}
+
+Fractal<dcomplex> deep_zoom(const std::string& center_re,
+                            const std::string& center_im, double radius,
+                            unsigned nacross, unsigned nup,
+                            const dcomplex& z0, double escape,
+                            unsigned max_iters, ThreadPool& pool)
+{
+    const double dx = nacross > 1 ? 2 * radius / (nacross - 1) : 0;
+    const double half_height = dx * (nup - 1) / 2;
+    const Domain<dcomplex> dom(dcomplex(-radius, -half_height),
+                               dcomplex(radius, half_height), nacross, nup);
+    auto offset = [&](unsigned k)
+    {
+        return dom.lower_left + dcomplex((k % nacross) * dx, (k / nacross) * dx);
+    };
+
+    unsigned bits = guard_bits;
+    if (dx > 0)
+        bits += static_cast<unsigned>(std::max(0.0, -std::log2(dx)));
+    const unsigned limbs = BigFixed::limbs_for(bits);
+    const BigFixed cre = BigFixed::parse(center_re, limbs);
+    const BigFixed cim = BigFixed::parse(center_im, limbs);
+
+    // The first reference is the center, and it's used for every pixel.
+    const Reference first = make_reference(
+        cre, cim, 0, z0, escape, max_iters, std::abs(dom.upper_right));
+    auto chk = [&](const Domain<dcomplex>& band, vector_slice<unsigned>& slice)
+    {
+        for (unsigned i = 0; i < band.nup; ++i)
+            for (unsigned j = 0; j < band.nacross; ++j)
+                slice[i*slice.stride() + j] = iterate(
+                    first, band.lower_left + dcomplex(j*dx, i*dx), escape,
+                    max_iters, true);
+    };
+    Fractal<dcomplex> frac = make_fractal(dom, chk, pool);
+
+    // Then the glitched pixels are redone with new references.
+    for (unsigned refs = 1; ; ++refs) {
+        std::vector<unsigned> todo;
+        for (unsigned k = 0; k < frac.values.size(); ++k)
+            if (frac.values[k] == glitched)
+                todo.push_back(k);
+        if (todo.empty())
+            break;
+
+        // The glitched pixel nearest to the middle of all of them.
+        dcomplex mean = 0;
+        for (unsigned k : todo)
+            mean += offset(k);
+        mean /= double(todo.size());
+        const unsigned pick = *std::min_element(
+            todo.begin(), todo.end(), [&](unsigned p, unsigned q)
+            {
+                return std::norm(offset(p) - mean) <
+                       std::norm(offset(q) - mean);
+            });
+        double reach = 0;
+        for (unsigned k : todo)
+            reach = std::max(reach, std::abs(offset(k) - offset(pick)));
+
+        const Reference ref = make_reference(cre, cim, offset(pick), z0,
+                                             escape, max_iters, reach);
+        // The last reference takes whatever it gets.
+        const bool check = refs + 1 < max_references;
+        parallel_for(todo.size(), pool, [&](unsigned t)
+        {
+            const unsigned k = todo[t];
+            frac.values[k] = iterate(ref, offset(k) - ref.offset, escape,
+                                     max_iters, check);
+        });
+    }
+    return frac;
+}
+
+}
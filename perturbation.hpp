@@ -0,0 +1,58 @@
+#pragma once
+
+/*
+ * Deep zooms into the Mandelbrot set by perturbation.
+ *
+ * Past a zoom of about 1e-6 the spacing of the pixels is below what a float
+ * can resolve, and past 1e-15 below what a double can. Iterating every pixel
+ * in high precision is far too slow, so instead one reference point C is
+ * iterated in high precision (see bigfixed.hpp), and each pixel C + dc is
+ * iterated as a difference from the reference orbit Z_n:
+ *
+ *     z_n = Z_n + d_n,    d_{n+1} = 2*Z_n*d_n + d_n^2 + dc
+ *
+ * The differences are small and only need the relative precision of a
+ * double (their exponent range is what limits the depth, to about 1e-300).
+ *
+ * The first iterations are shared by all pixels and skipped with a series
+ * approximation d_n ~ A_n*dc + B_n*dc^2 + C_n*dc^3, whose coefficients are
+ * iterated along with the reference orbit for as long as the cubic term stays
+ * negligible over the whole image.
+ *
+ * Where the pixel's orbit comes much closer to 0 than the reference orbit
+ * does, the difference loses all its precision and the result is wrong (a
+ * "glitch"). Such pixels are detected with |z_n| < 1e-3 |Z_n|, as are pixels
+ * still iterating when the reference orbit escapes. They're recomputed with
+ * a new reference picked among them, which is repeated until none are left
+ * (or up to a limit on the number of references).
+ *
+ * Only z^2 + c with the test point as c is supported.
+ */
+
+#include "fractals.hpp"
+#include "thread_pool.hpp"
+
+#include <complex>
+#include <string>
+
+namespace fractals
+{
+
+/*
+ * Compute the image of z^2 + c from z = z0 with 'nacross' x 'nup' points
+ * centered on center_re + i*center_im, given as decimal strings to any
+ * number of digits, with the left and right edges 'radius' away from the
+ * center and square pixels. The domain of the result holds the offsets of
+ * the corners from the center. Results are the same as those of ctestfun in
+ * options.hpp: the number of iterations to escape, or 0. The work is split
+ * between the threads of 'pool'.
+ */
+Fractal<std::complex<double>> deep_zoom(const std::string& center_re,
+                                        const std::string& center_im,
+                                        double radius, unsigned nacross,
+                                        unsigned nup,
+                                        const std::complex<double>& z0,
+                                        double escape, unsigned max_iters,
+                                        ThreadPool& pool);
+
+}
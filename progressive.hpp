@@ -0,0 +1,100 @@
+#pragma once
+
+/*
+ * Progressive rendering: a coarse image first, then finer and finer ones.
+ *
+ * The first pass tests every coarsest_step-th point in each direction. Each
+ * following pass halves the step and tests only the points that are new on
+ * the finer grid, so that when the last pass (step 1) is done every point has
+ * been tested exactly once and the total work is that of a single full
+ * render. After each pass the caller gets a preview of the whole image in
+ * which each point not tested yet has the value of the nearest tested point
+ * below and to the left of it.
+ */
+
+#include "fractals.hpp"
+#include "thread_pool.hpp"
+#include "vector_slice.hpp"
+
+#include <vector>
+
+namespace fractals
+{
+
+// Spacing, in points, of the grid tested by the first pass; a power of two.
+constexpr unsigned coarsest_step = 8;
+
+/*
+ * Test the points of 'dom' in passes as described above, split between the
+ * threads of 'pool', and return the finished image. 'kernel' tests rows of
+ * points as described for KernelSpec in options.hpp. 'show' is called with
+ * the preview after each pass but the last.
+ */
+template <typename cmplx, typename Kernel, typename Show>
+Fractal<cmplx> progressive(const Domain<cmplx>& dom, const Kernel& kernel,
+                           ThreadPool& pool, const Show& show)
+{
+    using real = typename cmplx::value_type;
+    const real dx = dom.nacross > 1 ?
+        (dom.upper_right.real() - dom.lower_left.real()) / (dom.nacross - 1) : 0;
+    const real dy = dom.nup > 1 ?
+        (dom.upper_right.imag() - dom.lower_left.imag()) / (dom.nup - 1) : 0;
+
+    Fractal<cmplx> result(dom);
+    Fractal<cmplx> preview(dom);
+    for (unsigned step = coarsest_step; step > 0; step /= 2) {
+        // The points of this pass's grid, of which those on even rows and
+        // columns were tested by the previous pass. make_fractal is given
+        // the grid's indices as points, so a tile's lower left corner tells
+        // its place exactly.
+        const unsigned nacross = (dom.nacross - 1) / step + 1;
+        const unsigned nup = (dom.nup - 1) / step + 1;
+        const Domain<cmplx> grid(cmplx(0, 0), cmplx(nacross - 1, nup - 1),
+                                 nacross, nup);
+        const bool first = step == coarsest_step;
+
+        auto chk = [&](const Domain<cmplx>& tile, vector_slice<unsigned>& slice)
+        {
+            const unsigned row0 = static_cast<unsigned>(tile.lower_left.imag());
+            const unsigned col0 = static_cast<unsigned>(tile.lower_left.real());
+            const unsigned n = tile.nacross;
+            std::vector<unsigned> buf(n / 2 + 1);
+            for (unsigned i = 0; i < tile.nup; ++i) {
+                const unsigned row = row0 + i;
+                const cmplx start = dom.lower_left +
+                    cmplx(col0 * step * dx, row * step * dy);
+                unsigned* out = &slice[i * slice.stride()];
+                if (first || row % 2 == 1) {
+                    kernel(start, step * dx, n, out);
+                    continue;
+                }
+                // Only the odd columns are new.
+                const unsigned skip = col0 % 2 == 0 ? 1 : 0;
+                const unsigned count = (n - skip + 1) / 2;
+                if (count > 0)
+                    kernel(start + cmplx(skip * step * dx, 0), 2 * step * dx,
+                           count, buf.data());
+                for (unsigned k = 0; k < count; ++k)
+                    out[2*k + skip] = buf[k];
+            }
+        };
+        const Fractal<cmplx> pass = make_fractal(grid, chk, pool);
+
+        for (unsigned a = 0; a < nup; ++a)
+            for (unsigned b = 0; b < nacross; ++b)
+                if (first || a % 2 == 1 || b % 2 == 1)
+                    result.values[a*step*dom.nacross + b*step] =
+                        pass.values[a*nacross + b];
+
+        if (step == 1)
+            break;
+        for (unsigned i = 0; i < dom.nup; ++i)
+            for (unsigned j = 0; j < dom.nacross; ++j)
+                preview.values[i*dom.nacross + j] =
+                    result.values[(i - i % step)*dom.nacross + j - j % step];
+        show(preview);
+    }
+    return result;
+}
+
+}
@@ -0,0 +1,168 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace fractals
+{
+
+std::vector<Tile> cut_into_tiles(unsigned nacross, unsigned nup,
+                                 unsigned side)
+{
+    // As even as possible.
+    const unsigned across = std::max(1u, (nacross + side - 1) / side);
+    const unsigned up = std::max(1u, (nup + side - 1) / side);
+    std::vector<Tile> tiles;
+    for (unsigned a = 0; a < up; ++a)
+        for (unsigned b = 0; b < across; ++b)
+            tiles.push_back(Tile{nup * a / up, nup * (a + 1) / up,
+                                 nacross * b / across,
+                                 nacross * (b + 1) / across});
+    return tiles;
+}
+
+unsigned balanced_tile_size(unsigned nacross, unsigned nup,
+                            unsigned num_workers)
+{
+    const double points = double(nacross) * nup;
+    const unsigned side = static_cast<unsigned>(
+        std::sqrt(points / (tiles_per_thread * std::max(1u, num_workers))));
+    return std::max(min_tile_size, std::min(tile_size, side));
+}
+
+TileScheduler::TileScheduler(unsigned nacross, unsigned nup,
+                             unsigned num_workers) :
+    queues_(std::max(1u, num_workers))
+{
+    const std::vector<Tile> tiles = cut_into_tiles(nacross, nup, tile_size);
+
+    // Each worker starts with a run of neighbouring tiles.
+    const unsigned n = tiles.size(), workers = queues_.size();
+    for (unsigned w = 0; w < workers; ++w)
+        queues_[w].tiles.assign(tiles.begin() + n * w / workers,
+                                tiles.begin() + n * (w + 1) / workers);
+    unfinished_ = n;
+}
+
+TileScheduler::TileScheduler(const std::vector<Tile>& tiles,
+                             const std::vector<double>& costs,
+                             unsigned num_workers) :
+    queues_(std::max(1u, num_workers)), stealing_(false)
+{
+    const unsigned workers = queues_.size();
+    double total = 0;
+    for (double c : costs)
+        total += c;
+
+    // A tile goes to the worker whose share of the total cost its middle
+    // falls in, or by count if nothing was measured.
+    double before = 0;
+    for (unsigned k = 0; k < tiles.size(); ++k) {
+        const double middle = total > 0 ? (before + costs[k] / 2) / total :
+                                          (k + 0.5) / tiles.size();
+        before += costs[k];
+        const unsigned w = std::min(workers - 1,
+                                    static_cast<unsigned>(middle * workers));
+        queues_[w].tiles.push_back(tiles[k]);
+    }
+    unfinished_ = tiles.size();
+}
+
+bool TileScheduler::next(unsigned w, Tile& tile)
+{
+    if (take_own(w, tile)) {
+        split(w, tile);
+        return true;
+    }
+    if (!stealing_)
+        return false;
+
+    ++idle_;
+    while (true) {
+        // Read before looking, so tiles added while looking aren't missed.
+        const unsigned long seen = added_;
+        if (steal(w, tile)) {
+            --idle_;
+            split(w, tile);
+            return true;
+        }
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        wake_.wait(lock, [&]()
+        {
+            return added_ != seen || unfinished_ == 0;
+        });
+        if (unfinished_ == 0) {
+            --idle_;
+            return false;
+        }
+    }
+}
+
+void TileScheduler::finished()
+{
+    if (--unfinished_ == 0) {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        wake_.notify_all();
+    }
+}
+
+bool TileScheduler::take_own(unsigned w, Tile& tile)
+{
+    Queue& q = queues_[w];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tiles.empty())
+        return false;
+    tile = q.tiles.front();
+    q.tiles.pop_front();
+    return true;
+}
+
+bool TileScheduler::steal(unsigned w, Tile& tile)
+{
+    const unsigned workers = queues_.size();
+    for (unsigned k = 1; k <= workers; ++k) {
+        Queue& q = queues_[(w + k) % workers];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tiles.empty())
+            continue;
+        tile = q.tiles.back();
+        q.tiles.pop_back();
+        return true;
+    }
+    return false;
+}
+
+void TileScheduler::split(unsigned w, Tile& tile)
+{
+    if (!stealing_ || idle_ == 0)
+        return;
+    const bool rows = tile.i1 - tile.i0 >= 2*min_tile_size;
+    const bool cols = tile.j1 - tile.j0 >= 2*min_tile_size;
+    if (!rows && !cols)
+        return;
+
+    // Keep the first piece and leave the others at the back of the deque,
+    // where they're taken from.
+    const unsigned im = rows ? (tile.i0 + tile.i1) / 2 : tile.i1;
+    const unsigned jm = cols ? (tile.j0 + tile.j1) / 2 : tile.j1;
+    std::vector<Tile> pieces;
+    if (cols)
+        pieces.push_back(Tile{tile.i0, im, jm, tile.j1});
+    if (rows)
+        pieces.push_back(Tile{im, tile.i1, tile.j0, jm});
+    if (rows && cols)
+        pieces.push_back(Tile{im, tile.i1, jm, tile.j1});
+    tile = Tile{tile.i0, im, tile.j0, jm};
+
+    unfinished_ += pieces.size();
+    {
+        Queue& q = queues_[w];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.tiles.insert(q.tiles.end(), pieces.begin(), pieces.end());
+    }
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+    ++added_;
+    wake_.notify_all();
+}
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+/*
+ * Handing out the work of one image to a set of threads.
+ *
+ * The image is cut into square tiles, and each thread gets a deque of
+ * neighbouring tiles to work through from the front. A thread that runs out
+ * takes tiles from the back of another thread's deque. The cost of a tile
+ * can't be known before it's computed (the inside of the Mandelbrot set can
+ * cost a thousand times what the outside does), so while some thread is out
+ * of work, every tile is cut in four before it's started, down to a minimum
+ * size, and the pieces are left where idle threads can take them. Near the
+ * end of an image that spreads the last expensive tiles over all threads.
+ *
+ * Alternatively the cost of each tile can be estimated first, by timing the
+ * computation of a sparse sample of its points, and each thread given a run
+ * of neighbouring tiles of about the same total cost to work through with no
+ * stealing. That keeps each thread's writes to its own part of the image,
+ * where moving work between threads is expensive (between the sockets of a
+ * multi-socket machine).
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace fractals
+{
+
+// Side, in points, of the tiles an image is first cut into, and the least
+// side of the pieces they're cut into.
+constexpr unsigned tile_size = 128;
+constexpr unsigned min_tile_size = 16;
+
+// Spacing, in points, of the samples used to estimate the cost of a tile.
+constexpr unsigned cost_sample_step = 8;
+// Tiles per thread (at least) when scheduling by estimated cost.
+constexpr unsigned tiles_per_thread = 16;
+
+// How make_fractal hands out tiles: by work stealing, or statically by
+// estimated cost.
+enum class schedule
+{
+    stealing, cost
+};
+
+// The points (i, j) with i0 <= i < i1 and j0 <= j < j1.
+struct Tile
+{
+    unsigned i0, i1;
+    unsigned j0, j1;
+};
+
+// Cut an image of 'nacross' x 'nup' points into tiles of about 'side'
+// points across, in row major order.
+std::vector<Tile> cut_into_tiles(unsigned nacross, unsigned nup,
+                                 unsigned side);
+
+// Side of the tiles to use for scheduling an image of 'nacross' x 'nup'
+// points statically between 'num_workers' threads.
+unsigned balanced_tile_size(unsigned nacross, unsigned nup,
+                            unsigned num_workers);
+
+/*
+ * The tiles of one image of 'nacross' x 'nup' points still to be computed
+ * by 'num_workers' threads, numbered from 0. Each call to make_fractal has
+ * its own, so calls can run at once.
+ */
+class TileScheduler
+{
+public:
+    // Tiles of tile_size, moved between workers as described above.
+    TileScheduler(unsigned nacross, unsigned nup, unsigned num_workers);
+
+    // 'tiles' with 'costs' estimated for them, given to the workers in runs
+    // of about equal cost and never moved.
+    TileScheduler(const std::vector<Tile>& tiles,
+                  const std::vector<double>& costs, unsigned num_workers);
+
+    TileScheduler(const TileScheduler&) = delete;
+    TileScheduler& operator=(const TileScheduler&) = delete;
+
+    /*
+     * Get the next tile for worker 'w' to compute, waiting for one if other
+     * workers may still make some available. Returns false once the whole
+     * image is done (or, without stealing, the worker's own tiles are).
+     * Each tile must be reported with finished() when it's computed.
+     */
+    bool next(unsigned w, Tile& tile);
+    void finished();
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+    std::vector<Queue> queues_;
+    bool stealing_ = true;
+
+    // Tiles handed out or waiting, but not finished.
+    std::atomic<unsigned> unfinished_;
+    // Workers looking for a tile to take.
+    std::atomic<unsigned> idle_{0};
+
+    // Idle workers wait on 'wake_' for tiles to be added or for the image to
+    // be done. 'added_' counts the additions.
+    std::mutex wait_mutex_;
+    std::condition_variable wake_;
+    std::atomic<unsigned long> added_{0};
+
+    bool take_own(unsigned w, Tile& tile);
+    bool steal(unsigned w, Tile& tile);
+    void split(unsigned w, Tile& tile);
+};
+
+}
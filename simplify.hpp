@@ -0,0 +1,251 @@
+#pragma once
+
+/*
+ * Constant folding and algebraic simplification of an Expression.
+ *
+ * simplify() rebuilds an expression bottom-up. Any node whose operands are
+ * all constant is evaluated once, here, in double precision, and identities
+ * like z*1, z*0, z+0, z/1, z^1 and -(-z) are removed. A few rewrites also
+ * make the remaining work cheaper: division by a constant becomes
+ * multiplication by its reciprocal, constants in chains like 2*(3*z) or
+ * 1+(z+2) are combined, x*x becomes a square and integer powers are expanded
+ * into squarings and multiplications.
+ */
+
+#include "expression.hpp"
+
+#include <cmath>
+#include <complex>
+#include <utility>
+#include <vector>
+
+namespace fractals {
+
+namespace fn_parser {
+
+/*
+ * Evaluate a single operation on constants. The semantics match those of
+ * the back ends in function_parser.hpp and bytecode.hpp.
+ */
+inline std::complex<double> fold(op code, const std::complex<double>& a,
+                                 const std::complex<double>& b)
+{
+    using cmplx = std::complex<double>;
+    switch (code) {
+    case op::NEG: return -a;
+    case op::ADD: return a + b;
+    case op::SUB: return a - b;
+    case op::MUL: return a * b;
+    case op::DIV: return a / b;
+    case op::POW: return std::pow(a, b);
+    case op::SQUARE: return a * a;
+    case op::ABS: return cmplx(std::abs(a));
+    case op::EXP: return std::exp(a);
+    case op::SIN: return std::sin(a);
+    case op::COS: return std::cos(a);
+    case op::TAN: return std::tan(a);
+    case op::ASIN: return std::asin(a);
+    case op::ACOS: return std::acos(a);
+    case op::ATAN: return std::atan(a);
+    case op::SQRT: return std::sqrt(a);
+    case op::REAL: return cmplx(a.real());
+    case op::IMAG: return cmplx(0, a.imag());
+    case op::CONJ: return std::conj(a);
+    default: return a;
+    }
+}
+
+class Simplifier
+{
+public:
+    explicit Simplifier(const Expression& in) : in_(in) {}
+
+    Expression run()
+    {
+        std::vector<unsigned> map(in_.size(), 0);
+        for (unsigned i = 0; i < in_.size(); ++i) {
+            const Node& n = in_[i];
+            switch (arity(n.code)) {
+            case 0:
+                map[i] = n.code == op::CONSTANT ? out_.add_constant(n.value) :
+                                                  out_.add_variable(n.code);
+                break;
+            case 1:
+                map[i] = unary(n.code, map[n.lhs]);
+                break;
+            default:
+                map[i] = binary(n.code, map[n.lhs], map[n.rhs]);
+                break;
+            }
+        }
+        out_.set_root(map[in_.root()]);
+        return out_;
+    }
+
+private:
+    const Expression& in_;
+    Expression out_;
+
+    bool is_constant(unsigned i) const
+    {
+        return out_[i].code == op::CONSTANT;
+    }
+
+    bool is_constant(unsigned i, const std::complex<double>& v) const
+    {
+        return is_constant(i) && out_[i].value == v;
+    }
+
+    const std::complex<double>& value(unsigned i) const
+    {
+        return out_[i].value;
+    }
+
+    unsigned unary(op code, unsigned a)
+    {
+        if (is_constant(a))
+            return out_.add_constant(fold(code, value(a), 0.0));
+        // -(-x) = x and conj(conj(x)) = x
+        if ((code == op::NEG || code == op::CONJ) && out_[a].code == code)
+            return out_[a].lhs;
+        return out_.add_unary(code, a);
+    }
+
+    unsigned binary(op code, unsigned a, unsigned b)
+    {
+        if (is_constant(a) && is_constant(b))
+            return out_.add_constant(fold(code, value(a), value(b)));
+
+        switch (code) {
+        case op::ADD:
+            if (is_constant(a, 0.0))
+                return b;
+            if (is_constant(b, 0.0))
+                return a;
+            // x + (-y) = x - y
+            if (out_[b].code == op::NEG)
+                return out_.add_binary(op::SUB, a, out_[b].lhs);
+            if (out_[a].code == op::NEG)
+                return out_.add_binary(op::SUB, b, out_[a].lhs);
+            return combine_constants(code, a, b);
+        case op::SUB:
+            if (is_constant(b, 0.0))
+                return a;
+            if (is_constant(a, 0.0))
+                return unary(op::NEG, b);
+            // x - (-y) = x + y
+            if (out_[b].code == op::NEG)
+                return out_.add_binary(op::ADD, a, out_[b].lhs);
+            // x - k = (-k) + x, which can be combined with other constants.
+            if (is_constant(b))
+                return combine_constants(op::ADD, out_.add_constant(-value(b)), a);
+            return out_.add_binary(code, a, b);
+        case op::MUL:
+            if (is_constant(a, 1.0))
+                return b;
+            if (is_constant(b, 1.0))
+                return a;
+            // The program is built with -ffast-math, which already assumes
+            // values are finite, so 0*x = 0.
+            if (is_constant(a, 0.0) || is_constant(b, 0.0))
+                return out_.add_constant(0.0);
+            if (is_constant(a, -1.0))
+                return unary(op::NEG, b);
+            if (is_constant(b, -1.0))
+                return unary(op::NEG, a);
+            // Operands are shared (see expression.hpp), so x*x is easy to
+            // spot.
+            if (a == b)
+                return unary(op::SQUARE, a);
+            return combine_constants(code, a, b);
+        case op::DIV:
+            if (is_constant(b, 1.0))
+                return a;
+            // Multiplying is a good deal cheaper than dividing.
+            if (is_constant(b))
+                return binary(op::MUL, out_.add_constant(1.0 / value(b)), a);
+            return out_.add_binary(code, a, b);
+        case op::POW:
+            if (is_constant(b, 1.0))
+                return a;
+            if (is_small_integer(b)) {
+                int n = int(value(b).real());
+                if (n > 0)
+                    return integer_power(a, n);
+                if (n < 0)
+                    return out_.add_binary(op::DIV, out_.add_constant(1.0),
+                                           integer_power(a, -n));
+            }
+            return out_.add_binary(code, a, b);
+        default:
+            return out_.add_binary(code, a, b);
+        }
+    }
+
+    // Largest exponent that is expanded into multiplications.
+    static constexpr int max_integer_power = 1024;
+
+    bool is_small_integer(unsigned i) const
+    {
+        if (!is_constant(i) || value(i).imag() != 0.0)
+            return false;
+        // In range first: converting a double that doesn't fit (or NaN) to
+        // int is undefined.
+        double x = value(i).real();
+        return std::abs(x) <= max_integer_power && x == double(int(x));
+    }
+
+    /*
+     * x^n for n >= 1 by repeated squaring, so std::pow's complex log and exp
+     * are replaced by about 2*log2(n) multiplications. Squares get their own
+     * operation since they only need two real multiplications.
+     */
+    unsigned integer_power(unsigned x, int n)
+    {
+        unsigned result = 0;
+        bool have_result = false;
+        while (true) {
+            if (n & 1) {
+                result = have_result ? out_.add_binary(op::MUL, result, x) : x;
+                have_result = true;
+            }
+            n >>= 1;
+            if (n == 0)
+                return result;
+            x = out_.add_unary(op::SQUARE, x);
+        }
+    }
+
+    /*
+     * For the commutative operations (+ and *): if one operand is a
+     * constant k1 and the other is the same operation applied to a constant
+     * k2 and some x, rewrite as (k1 op k2) op x. The Expression may put
+     * the operands of + and * in either order, so both sides are checked.
+     */
+    unsigned combine_constants(op code, unsigned a, unsigned b)
+    {
+        if (is_constant(b))
+            std::swap(a, b);
+        if (is_constant(a) && out_[b].code == code) {
+            unsigned inner_const = out_[b].lhs;
+            unsigned x = out_[b].rhs;
+            if (!is_constant(inner_const))
+                std::swap(inner_const, x);
+            if (is_constant(inner_const)) {
+                unsigned k = out_.add_constant(
+                    fold(code, value(a), value(inner_const)));
+                return binary(code, k, x);
+            }
+        }
+        return out_.add_binary(code, a, b);
+    }
+};
+
+inline Expression simplify(const Expression& expr)
+{
+    return Simplifier(expr).run();
+}
+
+}
+
+}
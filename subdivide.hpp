@@ -0,0 +1,160 @@
+#pragma once
+
+/*
+ * Rectangle subdivision (the Mariani-Silver algorithm) for filling a region
+ * of a domain with escape times.
+ *
+ * Only the border of a rectangle is tested. If every point on it got the same
+ * result, the whole interior is filled in with that result; otherwise the
+ * rectangle is cut in two along its longer side, the points on the cut are
+ * tested and both halves are handled the same way. This relies on the sets
+ * of points with a given escape time having no holes, which holds for the
+ * Mandelbrot set and connected Julia sets: a region of the interior or a band
+ * of the exterior can't hide anything that doesn't also show on a border
+ * around it. Features thinner than the spacing of the points (filaments, or
+ * the pieces of a disconnected Julia set) can be missed, so this is an option
+ * rather than the default, but in views with large flat areas it tests only a
+ * small fraction of the points.
+ */
+
+#include "fractals.hpp"
+#include "vector_slice.hpp"
+
+#include <algorithm>
+
+namespace fractals
+{
+
+// Rectangles with a side shorter than this are tested point by point rather
+// than cut again.
+constexpr unsigned min_subdivision = 8;
+
+/*
+ * Fills the points (i, j) with i0 <= i < i1 and j0 <= j < j1 of a domain,
+ * i.e. dom.lower_left + (j*dx, i*dy), into out[i*out.stride() + j], where
+ * dx and dy are the spacings of the points of 'dom'. 'kernel' tests points
+ * as described for KernelSpec in options.hpp.
+ */
+template <typename cmplx, typename Kernel>
+void subdivide(const Domain<cmplx>& dom, vector_slice<unsigned>& out,
+               const Kernel& kernel, unsigned i0, unsigned i1, unsigned j0,
+               unsigned j1);
+
+namespace
+{
+
+template <typename cmplx, typename Kernel>
+class Subdivision
+{
+public:
+    using real = typename cmplx::value_type;
+
+    Subdivision(const Domain<cmplx>& dom, vector_slice<unsigned>& out,
+                const Kernel& kernel) :
+        ll_(dom.lower_left), stride_(out.stride()), out_(out), kernel_(kernel)
+    {
+        dx_ = dom.nacross > 1 ? (dom.upper_right.real() - ll_.real()) /
+                                (dom.nacross - 1) : 0;
+        dy_ = dom.nup > 1 ? (dom.upper_right.imag() - ll_.imag()) /
+                            (dom.nup - 1) : 0;
+    }
+
+    // Points j0 <= j < j1 of row i.
+    void row(unsigned i, unsigned j0, unsigned j1)
+    {
+        if (j0 < j1)
+            kernel_(cmplx(ll_.real() + j0*dx_, ll_.imag() + i*dy_), dx_,
+                    j1 - j0, &at(i, j0));
+    }
+
+    // Points i0 <= i < i1 of column j.
+    void column(unsigned j, unsigned i0, unsigned i1)
+    {
+        for (unsigned i = i0; i < i1; ++i)
+            at(i, j) = kernel_(cmplx(ll_.real() + j*dx_, ll_.imag() + i*dy_));
+    }
+
+    /*
+     * Fill in the rectangle [i0, i1) x [j0, j1), whose border (rows i0 and
+     * i1 - 1, columns j0 and j1 - 1) has already been tested.
+     */
+    void interior(unsigned i0, unsigned i1, unsigned j0, unsigned j1)
+    {
+        if (i1 - i0 <= 2 || j1 - j0 <= 2)
+            return;
+
+        if (uniform_border(i0, i1, j0, j1)) {
+            const unsigned v = at(i0, j0);
+            for (unsigned i = i0 + 1; i < i1 - 1; ++i)
+                std::fill(&at(i, j0 + 1), &at(i, j1 - 1), v);
+            return;
+        }
+
+        if (i1 - i0 < min_subdivision || j1 - j0 < min_subdivision) {
+            for (unsigned i = i0 + 1; i < i1 - 1; ++i)
+                row(i, j0 + 1, j1 - 1);
+            return;
+        }
+
+        // The cut is shared by both halves as part of their borders. Kernels
+        // test rows several points at a time but columns one by one, so
+        // rectangles are cut along a row unless they're quite wide.
+        if (j1 - j0 >= 2*(i1 - i0)) {
+            const unsigned m = j0 + (j1 - j0) / 2;
+            column(m, i0 + 1, i1 - 1);
+            interior(i0, i1, j0, m + 1);
+            interior(i0, i1, m, j1);
+        } else {
+            const unsigned m = i0 + (i1 - i0) / 2;
+            row(m, j0 + 1, j1 - 1);
+            interior(i0, m + 1, j0, j1);
+            interior(m, i1, j0, j1);
+        }
+    }
+
+private:
+    cmplx ll_;
+    real dx_;
+    real dy_;
+    unsigned stride_;
+    vector_slice<unsigned>& out_;
+    const Kernel& kernel_;
+
+    unsigned& at(unsigned i, unsigned j)
+    {
+        return out_[i*stride_ + j];
+    }
+
+    bool uniform_border(unsigned i0, unsigned i1, unsigned j0, unsigned j1)
+    {
+        const unsigned v = at(i0, j0);
+        for (unsigned j = j0; j < j1; ++j)
+            if (at(i0, j) != v || at(i1 - 1, j) != v)
+                return false;
+        for (unsigned i = i0 + 1; i < i1 - 1; ++i)
+            if (at(i, j0) != v || at(i, j1 - 1) != v)
+                return false;
+        return true;
+    }
+};
+
+}
+
+template <typename cmplx, typename Kernel>
+void subdivide(const Domain<cmplx>& dom, vector_slice<unsigned>& out,
+               const Kernel& kernel, unsigned i0, unsigned i1, unsigned j0,
+               unsigned j1)
+{
+    if (i0 >= i1 || j0 >= j1)
+        return;
+    Subdivision<cmplx, Kernel> sub(dom, out, kernel);
+    sub.row(i0, j0, j1);
+    if (i1 - i0 > 1)
+        sub.row(i1 - 1, j0, j1);
+    sub.column(j0, i0 + 1, i1 - 1);
+    if (j1 - j0 > 1)
+        sub.column(j1 - 1, i0 + 1, i1 - 1);
+    sub.interior(i0, i1, j0, j1);
+}
+
+}
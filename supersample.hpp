@@ -0,0 +1,112 @@
+#pragma once
+
+/*
+ * Adaptive supersampling: anti-aliasing only where it shows.
+ *
+ * Every pixel gets one sample first. A pixel whose iteration count differs
+ * from that of one of its eight neighbours by more than a threshold (or
+ * which is on the edge between points that escape and points that don't)
+ * is then sampled again on a samples x samples grid spread over its area,
+ * and its color is the average of the colors of those samples. Everywhere
+ * else the color of the single sample is kept. Smooth areas, which are most
+ * of a typical image, cost no more than without anti-aliasing.
+ */
+
+#include "fractals.hpp"
+#include "vector_slice.hpp"
+
+#include <vector>
+
+namespace fractals
+{
+
+/*
+ * Fill 'out' with the colors of the points of 'dom', 'dx' apart horizontally
+ * and 'dy' vertically.
+ * 'count' fills a vector_slice<unsigned> with the iteration counts of the
+ * points of a domain, like the checker given to make_fractal; 'kernel'
+ * tests rows of points as described for KernelSpec in options.hpp, and
+ * 'color' maps an iteration count to a Color.
+ */
+template <typename cmplx, typename Count, typename Kernel, typename ColorFn>
+void supersample(const Domain<cmplx>& dom, typename cmplx::value_type dx,
+                 typename cmplx::value_type dy, vector_slice<Color>& out, const Count& count,
+                 const Kernel& kernel, const ColorFn& color, unsigned samples,
+                 unsigned threshold)
+{
+    using real = typename cmplx::value_type;
+    const unsigned n = dom.nacross;
+
+    // One sample per point, with a row and column more on each side so the
+    // points on the edges have all of their neighbours.
+    const unsigned m = n + 2;
+    const Domain<cmplx> padded(dom.lower_left - cmplx(dx, dy),
+                               dom.upper_right + cmplx(dx, dy), m, dom.nup + 2);
+    std::vector<unsigned> counts(m * padded.nup);
+    vector_slice<unsigned> counts_slice(counts, 0, m);
+    count(padded, counts_slice);
+
+    auto differ = [&](unsigned a, unsigned b)
+    {
+        if ((a == 0) != (b == 0))
+            return true;
+        return (a > b ? a - b : b - a) > threshold;
+    };
+
+    const real sx = dx / samples, sy = dy / samples;
+    std::vector<bool> edge(n);
+    std::vector<unsigned> row;
+    std::vector<unsigned> sums;
+    for (unsigned i = 0; i < dom.nup; ++i) {
+        for (unsigned j = 0; j < n; ++j) {
+            const unsigned here = counts[(i + 1)*m + j + 1];
+            edge[j] = false;
+            for (unsigned k = i; k < i + 3 && !edge[j]; ++k)
+                for (unsigned l = j; l < j + 3; ++l)
+                    edge[j] = edge[j] || differ(here, counts[k*m + l]);
+            if (!edge[j])
+                out[i*out.stride() + j] = color(here);
+        }
+
+        // Samples are at the centers of a samples x samples grid of cells
+        // covering each pixel. The cells of neighbouring pixels line up, so
+        // a run of pixels is sampled a whole row of cells at a time.
+        for (unsigned j0 = 0; j0 < n; ) {
+            if (!edge[j0]) {
+                ++j0;
+                continue;
+            }
+            unsigned j1 = j0 + 1;
+            while (j1 < n && edge[j1])
+                ++j1;
+
+            const unsigned width = (j1 - j0) * samples;
+            row.resize(width);
+            sums.assign(3 * (j1 - j0), 0);
+            const cmplx corner = dom.lower_left +
+                cmplx(j0*dx - (dx - sx) / 2, i*dy - (dy - sy) / 2);
+            for (unsigned a = 0; a < samples; ++a) {
+                kernel(corner + cmplx(0, a*sy), sx, width, row.data());
+                for (unsigned k = 0; k < width; ++k) {
+                    const Color c = color(row[k]);
+                    unsigned* sum = &sums[3 * (k / samples)];
+                    sum[0] += c.r;
+                    sum[1] += c.g;
+                    sum[2] += c.b;
+                }
+            }
+
+            const unsigned total = samples * samples;
+            for (unsigned j = j0; j < j1; ++j) {
+                const unsigned* sum = &sums[3 * (j - j0)];
+                out[i*out.stride() + j] = Color{
+                    static_cast<unsigned char>((sum[0] + total / 2) / total),
+                    static_cast<unsigned char>((sum[1] + total / 2) / total),
+                    static_cast<unsigned char>((sum[2] + total / 2) / total)};
+            }
+            j0 = j1;
+        }
+    }
+}
+
+}
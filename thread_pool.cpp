@@ -0,0 +1,197 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace fractals
+{
+
+namespace
+{
+
+#ifdef __linux__
+// The CPUs in the affinity mask of the process.
+std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+    return cpus;
+}
+
+// The directories of the cgroup 'path' and of its ancestors up to the
+// root, 'mount', innermost first.
+std::vector<std::string> cgroup_ancestors(const std::string& mount,
+                                          std::string path)
+{
+    std::vector<std::string> dirs;
+    while (!path.empty() && path != "/") {
+        dirs.push_back(mount + path);
+        const auto slash = path.rfind('/');
+        path.erase(slash == std::string::npos ? 0 : slash);
+    }
+    dirs.push_back(mount);
+    return dirs;
+}
+
+/*
+ * CPUs' worth of time per second the process's cgroup may use, or 0 if
+ * there's no limit. Handles cgroup v2 (cpu.max) and v1 (cpu.cfs_quota_us
+ * and cpu.cfs_period_us). A cgroup gets no more than any of its ancestors,
+ * so this is the least quota on the way up to the root. Ancestors that
+ * aren't visible (above the root of a container's cgroup namespace) can't
+ * be taken into account.
+ */
+double cgroup_cpu_quota()
+{
+    std::string v2_path, v1_path;
+    std::ifstream groups("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(groups, line)) {
+        // hierarchy-ID:controller-list:path
+        const auto first = line.find(':');
+        const auto second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos)
+            continue;
+        const std::string controllers =
+            line.substr(first + 1, second - first - 1);
+        const std::string path = line.substr(second + 1);
+        if (line.compare(0, first, "0") == 0 && controllers.empty())
+            v2_path = path;
+        std::istringstream list(controllers);
+        std::string controller;
+        while (std::getline(list, controller, ','))
+            if (controller == "cpu")
+                v1_path = path;
+    }
+
+    double least = 0;
+    bool found = false;
+    auto limit = [&](double quota)
+    {
+        if (quota > 0 && (least == 0 || quota < least))
+            least = quota;
+    };
+    for (const std::string& dir : cgroup_ancestors("/sys/fs/cgroup",
+                                                   v2_path)) {
+        std::ifstream max(dir + "/cpu.max");
+        std::string quota;
+        double period;
+        if (max >> quota >> period) {
+            found = true;
+            if (quota != "max" && period > 0)
+                limit(std::stod(quota) / period);
+        }
+    }
+    if (found)
+        return least;
+    for (const std::string& dir : cgroup_ancestors("/sys/fs/cgroup/cpu",
+                                                   v1_path)) {
+        std::ifstream quota_file(dir + "/cpu.cfs_quota_us");
+        std::ifstream period_file(dir + "/cpu.cfs_period_us");
+        double quota, period;
+        if (quota_file >> quota && period_file >> period && period > 0)
+            limit(quota / period);
+    }
+    return least;
+}
+#endif
+
+}
+
+unsigned available_cpus()
+{
+    unsigned cpus = std::thread::hardware_concurrency();
+#ifdef __linux__
+    const std::vector<int> allowed = allowed_cpus();
+    if (!allowed.empty())
+        cpus = allowed.size();
+    const double quota = cgroup_cpu_quota();
+    if (quota > 0)
+        cpus = std::min(cpus, static_cast<unsigned>(std::ceil(quota)));
+#endif
+    return std::max(1u, cpus);
+}
+
+ThreadPool::ThreadPool(unsigned num_threads, bool pin)
+{
+    num_threads = std::max(1u, num_threads);
+    std::vector<int> cpus;
+#ifdef __linux__
+    if (pin)
+        cpus = allowed_cpus();
+#endif
+    for (unsigned t = 0; t < num_threads; ++t)
+        threads_.emplace_back(&ThreadPool::worker, this, t,
+                              cpus.empty() ? -1 : cpus[t % cpus.size()]);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& thr : threads_)
+        thr.join();
+}
+
+void ThreadPool::run(const std::function<void(unsigned)>& work)
+{
+    std::lock_guard<std::mutex> job(job_mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_ = &work;
+    busy_ = threads_.size();
+    ++generation_;
+    wake_.notify_all();
+    done_.wait(lock, [&]() { return busy_ == 0; });
+    work_ = nullptr;
+}
+
+void ThreadPool::worker(unsigned index, int cpu)
+{
+#ifdef __linux__
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#else
+    (void)cpu;
+#endif
+
+    unsigned long seen = 0;
+    while (true) {
+        const std::function<void(unsigned)>* work;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+            if (stop_)
+                return;
+            seen = generation_;
+            work = work_;
+        }
+        (*work)(index);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--busy_ == 0)
+                done_.notify_one();
+        }
+    }
+}
+
+}
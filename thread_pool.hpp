@@ -0,0 +1,75 @@
+#pragma once
+
+/*
+ * A fixed set of worker threads that runs one job after another.
+ *
+ * Starting and joining threads for every image costs a noticeable fraction
+ * of the time of a small render, and the new threads start with cold caches.
+ * A ThreadPool starts its threads once; between jobs they sleep on a
+ * condition variable (a futex on Linux) and don't use any CPU time.
+ *
+ * On Linux the workers can also be pinned each to its own CPU, so they keep
+ * their caches and the memory they write first stays on their NUMA node.
+ */
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fractals
+{
+
+/*
+ * Number of CPUs this process may run on: those in its affinity mask,
+ * limited by the CPU quotas of its cgroup and the cgroups above it, if any.
+ * At least 1.
+ */
+unsigned available_cpus();
+
+class ThreadPool
+{
+public:
+    // Start 'num_threads' workers (at least one). With 'pin', worker t only
+    // runs on the t-th CPU of the process's affinity mask (modulo their
+    // number); pinning is ignored where it isn't supported.
+    explicit ThreadPool(unsigned num_threads, bool pin = false);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const
+    {
+        return threads_.size();
+    }
+
+    /*
+     * Call work(t) on each worker, with t its index from 0 to size() - 1, and
+     * return when all calls have returned. Jobs given from several threads at
+     * once run one after another. Calling run() from a job deadlocks.
+     */
+    void run(const std::function<void(unsigned)>& work);
+
+private:
+    std::vector<std::thread> threads_;
+
+    // Held by run() for the whole of a job.
+    std::mutex job_mutex_;
+
+    // Guard everything below.
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(unsigned)>* work_ = nullptr;
+    // Counts jobs, so workers can tell a new job from a spurious wake up.
+    unsigned long generation_ = 0;
+    unsigned busy_ = 0;
+    bool stop_ = false;
+
+    // 'cpu' is the CPU to pin the worker to, or -1.
+    void worker(unsigned index, int cpu);
+};
+
+}
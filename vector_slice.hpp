@@ -5,43 +5,51 @@
 
 /*
  * This is a utility class that I use in the fractal code to represent a 
- * "window" into a vector. Very simply just holds a pointer to the vector
- * and an offset at which we start reading/writing from the vector. No bounds
- * checking is done since I wanted minimal overhead.
+ * "window" into a vector. Very simply just holds a pointer to the element
+ * of the vector at which we start reading/writing. No bounds checking is
+ * done since I wanted minimal overhead.
+ *
+ * The window is onto a rectangle of a row-major array, like a tile of an
+ * image: 'stride' is the distance in the vector between the starts of
+ * successive rows, so element j of row i is [i*stride() + j].
  */
-template <class Vec>
+template <class T>
 class Slice
 {
 private:
-    Vec* vec_;
-    unsigned start_;
+    T* data_;
+    unsigned stride_;
 public:
 
-    Slice(Vec& v, unsigned begin) : vec_(&v), start_(begin)
+    template <class Vec>
+    Slice(Vec& v, unsigned begin, unsigned stride) : stride_(stride)
     {
-        if (!(begin < vec_->size())) {
+        if (!(begin < v.size())) {
             throw(std::out_of_range("The beginning of the range specified is "
                                     "greater than the size of given vector."));
         }
+        data_ = v.data() + begin;
     }
 
-    Slice() : vec_(nullptr), start_(0) {}
+    Slice() : data_(nullptr), stride_(0) {}
     
-    using value_type = typename Vec::value_type;
+    using value_type = T;
+
+    unsigned stride() const { return stride_; }
 
     value_type& operator[](unsigned i)
     { 
-        return (*vec_)[i + start_]; 
+        return data_[i]; 
     }
     const value_type& operator[](unsigned i) const
     { 
-        return (*vec_)[i + start_]; 
+        return data_[i]; 
     }
 };
 
 template <typename T>
-using vector_slice = Slice<std::vector<T>>;
+using vector_slice = Slice<T>;
 
 template <typename T>
-using const_vector_slice = Slice<const std::vector<T>>;
+using const_vector_slice = Slice<const T>;
 